@@ -1,17 +1,30 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
 //
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
-// * After changing buffer data, call bwrite to write it to disk.
+// * After changing buffer data, call bwrite to write it to disk,
+//     or bwritev to write many buffers at once.
 // * When done with the buffer, call brelse.
+// * To read file data for the page cache without caching
+//     it here too, call breadv.
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+//
+// Each hash bucket has its own lock, so lookups of blocks that
+// hash to different buckets never contend. Only a miss, which
+// must recycle the least recently released unused buffer, takes
+// bcache.lock, to keep two processes from caching the same block
+// twice.
+//
+// The number of buffers is set at boot from the memory size.
+// Recycling looks at a bounded window of buffers after a clock
+// hand, so the cost of a miss does not grow with the cache.
 
 
 #include "types.h"
@@ -19,74 +32,200 @@
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "riscv.h"
+#include "memlayout.h"
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
 
-struct {
+#define NBUCKET 1021
+#define BHASH(dev, blockno) (((dev) * 31 + (blockno)) % NBUCKET)
+
+// how many unused buffers brecycle() compares.
+#define BSCAN 32
+
+extern char end[]; // first address after kernel.
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf *head;
+};
 
-  // Linked list of all buffers, through prev/next.
-  // head.next is most recently used.
-  struct buf head;
+struct {
+  struct spinlock lock;  // serializes recycling on a miss
+  int nbuf;
+  struct buf *hand;      // where brecycle() looks next
+  struct bucket bucket[NBUCKET];
 } bcache;
 
+// Allocate the buffers from the page allocator: enough for
+// 1/BCACHEFRAC of the memory above the kernel, but at least NBUF.
+// The buf structs and their data are packed into separate
+// pages, so that no data block straddles a page.
 void
 binit(void)
 {
-  struct buf *b;
+  struct buf *b, *bufs, *last;
+  uchar *data;
+  int i;
 
   initlock(&bcache.lock, "bcache");
+  for(i = 0; i < NBUCKET; i++)
+    initlock(&bcache.bucket[i].lock, "bcache.bucket");
+
+  bcache.nbuf = (PHYSTOP - (uint64)end) / BCACHEFRAC / (BSIZE + sizeof(struct buf));
+  if(bcache.nbuf < NBUF)
+    bcache.nbuf = NBUF;
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
+  // All buffers start out unused, in the bucket for block 0,
+  // and linked into a ring through b->link.
+  bufs = 0;
+  data = 0;
+  last = 0;
+  for(i = 0; i < bcache.nbuf; i++){
+    if(i % (PGSIZE / sizeof(struct buf)) == 0){
+      if((bufs = kalloc()) == 0)
+        panic("binit");
+      memset(bufs, 0, PGSIZE);
+    }
+    if(i % (PGSIZE / BSIZE) == 0 && (data = kalloc()) == 0)
+      panic("binit");
+    b = &bufs[i % (PGSIZE / sizeof(struct buf))];
+    b->data = data + (i % (PGSIZE / BSIZE)) * BSIZE;
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->next = bcache.bucket[BHASH(0, 0)].head;
+    bcache.bucket[BHASH(0, 0)].head = b;
+    if(last)
+      last->link = b;
+    else
+      bcache.hand = b;
+    last = b;
   }
+  last->link = bcache.hand;
 }
 
-// Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
-// In either case, return locked buffer.
+// Return how many buffers the cache has.
+int
+bcachesize(void)
+{
+  return bcache.nbuf;
+}
+
+// Look for block blockno on device dev in bucket bk,
+// which must be locked. Takes a reference if found.
 static struct buf*
-bget(uint dev, uint blockno)
+bfind(struct bucket *bk, uint dev, uint blockno)
 {
   struct buf *b;
 
-  acquire(&bcache.lock);
-
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
+  for(b = bk->head; b; b = b->next){
     if(b->dev == dev && b->blockno == blockno){
       b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
       return b;
     }
   }
+  return 0;
+}
 
-  // Not cached; recycle an unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
+// Recycle the least recently used unused buffer to cache
+// block blockno on device dev, which must not be cached.
+// Caller must hold bcache.lock. Returns the buffer referenced
+// and locked, or 0 if every buffer is in use.
+static struct buf*
+brecycle(uint dev, uint blockno)
+{
+  struct bucket *bk = &bcache.bucket[BHASH(dev, blockno)];
+  struct bucket *old;
+  struct buf *b, **pp;
+
+  // Take the least recently used of the next BSCAN unused
+  // buffers after the hand, which then moves past the victim,
+  // so a miss costs about the same however big the cache is.
+  // Skip buffers that a read-ahead still has at the disk.
+  // The scan reads refcnt without bucket locks, so re-check
+  // it once the victim's bucket is locked. A buffer's bucket
+  // can't change under us, since only this code moves buffers
+  // and it holds bcache.lock.
+  for(;;){
+    struct buf *victim = 0;
+    int i, n = 0;
+    for(b = bcache.hand, i = 0; i < bcache.nbuf && n < BSCAN; b = b->link, i++){
+      if(b->refcnt == 0 && !b->disk){
+        n++;
+        if(victim == 0 || b->timestamp < victim->timestamp)
+          victim = b;
+      }
+    }
+    if(victim == 0)
+      return 0;
+    bcache.hand = victim->link;
+    b = victim;
+    old = &bcache.bucket[BHASH(b->dev, b->blockno)];
+    acquire(&old->lock);
+    if(b->refcnt == 0 && !b->disk)
+      break;
+    release(&old->lock);
+  }
+
+  for(pp = &old->head; *pp != b; pp = &(*pp)->next)
+    ;
+  *pp = b->next;
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->readahead = 0;
+  b->refcnt = 1;
+
+  // No one else can hold an unreferenced buffer's lock,
+  // so this doesn't sleep.
+  acquiresleep(&b->lock);
+  release(&old->lock);
+
+  acquire(&bk->lock);
+  b->next = bk->head;
+  bk->head = b;
+  release(&bk->lock);
+
+  return b;
+}
+
+// Look through buffer cache for block on device dev.
+// If not found, allocate a buffer.
+// In either case, return locked buffer.
+static struct buf*
+bget(uint dev, uint blockno)
+{
+  struct bucket *bk = &bcache.bucket[BHASH(dev, blockno)];
+  struct buf *b;
+
+  // Is the block already cached?
+  acquire(&bk->lock);
+  b = bfind(bk, dev, blockno);
+  release(&bk->lock);
+
+  if(b == 0){
+    // Not cached. Look again holding bcache.lock, in case
+    // another process cached it since we released bk->lock.
+    acquire(&bcache.lock);
+    acquire(&bk->lock);
+    b = bfind(bk, dev, blockno);
+    release(&bk->lock);
+    if(b == 0){
+      // Recycle an unused buffer; it comes back locked.
+      if((b = brecycle(dev, blockno)) == 0)
+        panic("bget: no buffers");
       release(&bcache.lock);
-      acquiresleep(&b->lock);
       return b;
     }
+    release(&bcache.lock);
   }
-  panic("bget: no buffers");
+
+  acquiresleep(&b->lock);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
+// If bprefetch() already started reading the block, just wait
+// for that read to finish.
 struct buf*
 bread(uint dev, uint blockno)
 {
@@ -94,12 +233,142 @@ bread(uint dev, uint blockno)
 
   b = bget(dev, blockno);
   if(!b->valid) {
-    virtio_disk_rw(b->dev, b, 0);
+    if(!b->readahead)
+      virtio_disk_submit(b->dev, b, b->blockno, 0);
+    virtio_disk_wait(b->dev, b);
     b->valid = 1;
+    b->readahead = 0;
   }
   return b;
 }
 
+// Return a locked, recycled buffer for block blockno on
+// device dev, or 0 if it is already cached or every buffer
+// is in use.
+static struct buf*
+bgetnew(uint dev, uint blockno)
+{
+  struct bucket *bk = &bcache.bucket[BHASH(dev, blockno)];
+  struct buf *b;
+
+  acquire(&bk->lock);
+  for(b = bk->head; b; b = b->next)
+    if(b->dev == dev && b->blockno == blockno)
+      break;
+  release(&bk->lock);
+  if(b)
+    return 0;
+
+  acquire(&bcache.lock);
+  acquire(&bk->lock);
+  for(b = bk->head; b; b = b->next)
+    if(b->dev == dev && b->blockno == blockno)
+      break;
+  release(&bk->lock);
+  b = b ? 0 : brecycle(dev, blockno);
+  release(&bcache.lock);
+  return b;
+}
+
+// Start reading a run of freshly recycled buffers from
+// consecutive blocks, and release them without waiting.
+static void
+bstartread(struct buf **run, int n)
+{
+  if(n == 0)
+    return;
+  for(int i = 0; i < n; i++)
+    run[i]->readahead = 1;
+  virtio_disk_submitv(run[0]->dev, run, n, run[0]->blockno, 0);
+  for(int i = 0; i < n; i++)
+    brelse(run[i]);
+}
+
+// Start reading the n blocks in blocks[] on device dev into
+// the cache in the background, skipping any that are already
+// cached. Runs of adjacent blocks go to the disk as single
+// requests. Never waits for the disk, and gives up on blocks
+// rather than panic if every buffer is in use.
+void
+bprefetch(uint dev, uint *blocks, int n)
+{
+  struct buf *run[16], *b;
+  int nrun = 0;
+
+  for(int i = 0; i < n; i++){
+    if(nrun > 0 && (nrun == NELEM(run) ||
+                    blocks[i] != run[nrun-1]->blockno + 1)){
+      bstartread(run, nrun);
+      nrun = 0;
+    }
+    // Only freshly recycled buffers are locked here, so
+    // holding several at once can't deadlock.
+    if((b = bgetnew(dev, blocks[i])) != 0)
+      run[nrun++] = b;
+  }
+  bstartread(run, nrun);
+}
+
+// Read the n blocks in blocks[] on device dev into dst[],
+// BSIZE bytes each, without caching them; this is how the
+// page cache reads file data. A block that the cache has is
+// copied from its buffer, which may be newer than the disk.
+// The others are read straight into dst, runs of adjacent
+// blocks as single requests, and all at once; or, if memory
+// is short, one at a time through the cache.
+void
+breadv(uint dev, uint *blocks, uchar **dst, int n)
+{
+  struct bucket *bk;
+  struct buf *bv, *b, *run[PGSIZE / sizeof(struct buf)];
+  int i, j, k, nrun;
+
+  if(n == 0)
+    return;
+  // the request structs are too big for the kernel stack.
+  if((bv = kalloc()) == 0){
+    for(i = 0; i < n; i++){
+      b = bread(dev, blocks[i]);
+      memmove(dst[i], b->data, BSIZE);
+      brelse(b);
+    }
+    return;
+  }
+
+  for(i = 0; i < n; ){
+    nrun = 0;
+    for(; i < n && nrun < NELEM(run); i++){
+      bk = &bcache.bucket[BHASH(dev, blocks[i])];
+      acquire(&bk->lock);
+      for(b = bk->head; b; b = b->next)
+        if(b->dev == dev && b->blockno == blocks[i])
+          break;
+      release(&bk->lock);
+      if(b){
+        b = bread(dev, blocks[i]);
+        memmove(dst[i], b->data, BSIZE);
+        brelse(b);
+        continue;
+      }
+      b = &bv[nrun];
+      memset(b, 0, sizeof(*b));
+      b->dev = dev;
+      b->blockno = blocks[i];
+      b->data = dst[i];
+      run[nrun++] = b;
+    }
+    for(j = 0; j < nrun; j = k){
+      for(k = j + 1; k < nrun; k++)
+        if(run[k]->blockno != run[j]->blockno + (k - j))
+          break;
+      virtio_disk_submitv(dev, run + j, k - j, run[j]->blockno, 0);
+    }
+    for(j = 0; j < nrun; j++)
+      virtio_disk_wait(dev, run[j]);
+  }
+  kfree(bv);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -109,43 +378,83 @@ bwrite(struct buf *b)
   virtio_disk_rw(b->dev, b, 1);
 }
 
+// Write the n locked buffers in bv to disk, and wait for all
+// of the writes to finish.
+// If blockno is 0, each buffer goes to its own block: bv is
+// sorted by block number, and runs of adjacent blocks go to
+// the disk as single requests. Otherwise the buffers go to
+// consecutive blocks starting at blockno, all in one request,
+// which is how log.c writes cached blocks into the log.
+void
+bwritev(struct buf **bv, int n, uint blockno)
+{
+  struct buf *b;
+  int i, j;
+
+  for(i = 0; i < n; i++)
+    if(!holdingsleep(&bv[i]->lock))
+      panic("bwritev");
+  if(n == 0)
+    return;
+
+  if(blockno){
+    virtio_disk_submitv(bv[0]->dev, bv, n, blockno, 1);
+  } else {
+    for(i = 1; i < n; i++){
+      b = bv[i];
+      for(j = i; j > 0 && bv[j-1]->blockno > b->blockno; j--)
+        bv[j] = bv[j-1];
+      bv[j] = b;
+    }
+    for(i = 0; i < n; i = j){
+      for(j = i + 1; j < n; j++)
+        if(bv[j]->dev != bv[i]->dev || bv[j]->blockno != bv[i]->blockno + (j - i))
+          break;
+      virtio_disk_submitv(bv[i]->dev, bv + i, j - i, bv[i]->blockno, 1);
+    }
+  }
+
+  for(i = 0; i < n; i++)
+    virtio_disk_wait(bv[i]->dev, bv[i]);
+}
+
 // Release a locked buffer.
-// Move to the head of the MRU list.
+// Stamp it with the time, for LRU recycling in bget().
 void
 brelse(struct buf *b)
 {
+  struct bucket *bk;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+  acquire(&bk->lock);
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->timestamp = ticks;
   }
-  
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+
+  acquire(&bk->lock);
   b->refcnt--;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
-
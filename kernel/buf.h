@@ -1,12 +1,14 @@
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
+  int readahead; // read started by bprefetch()?
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
-  struct buf *next;
-  uchar data[BSIZE];
+  uint timestamp; // ticks at last brelse, for LRU eviction
+  struct buf *next; // hash bucket chain
+  struct buf *link; // ring of all buffers, for recycling
+  uchar *data;      // BSIZE bytes, from a page of kalloc()
 };
 
@@ -59,20 +59,26 @@ struct {
 
 //
 // user write()s to the console go here.
+// the bytes are copied in before taking cons.lock,
+// since copying from user memory may fault and sleep.
 //
 int
 consolewrite(struct file *f, int user_src, uint64 src, int n)
 {
-  int i;
-
-  acquire(&cons.lock);
-  for(i = 0; i < n; i++){
-    char c;
-    if(either_copyin(&c, user_src, src+i, 1) == -1)
+  int i, j, m;
+  char buf[128];
+
+  for(i = 0; i < n; i += m){
+    m = n - i;
+    if(m > sizeof(buf))
+      m = sizeof(buf);
+    if(either_copyin(buf, user_src, src+i, m) == -1)
       break;
-    consputc(c);
+    acquire(&cons.lock);
+    for(j = 0; j < m; j++)
+      consputc(buf[j]);
+    release(&cons.lock);
   }
-  release(&cons.lock);
 
   return n;
 }
@@ -81,15 +87,18 @@ consolewrite(struct file *f, int user_src, uint64 src, int n)
 // user read()s from the console go here.
 // copy (up to) a whole input line to dst.
 // user_dist indicates whether dst is a user
-// or kernel address.
+// or kernel address. the line is copied out
+// after releasing cons.lock.
 //
 int
 consoleread(struct file *f, int user_dst, uint64 dst, int n)
 {
   uint target;
   int c;
-  char cbuf;
+  char buf[INPUT_BUF];
 
+  if(n > INPUT_BUF)
+    n = INPUT_BUF;
   target = n;
   acquire(&cons.lock);
   while(n > 0){
@@ -114,12 +123,7 @@ consoleread(struct file *f, int user_dst, uint64 dst, int n)
       break;
     }
 
-    // copy the input byte to the user-space buffer.
-    cbuf = c;
-    if(either_copyout(user_dst, dst, &cbuf, 1) == -1)
-      break;
-
-    dst++;
+    buf[target - n] = c;
     --n;
 
     if(c == '\n'){
@@ -130,6 +134,10 @@ consoleread(struct file *f, int user_dst, uint64 dst, int n)
   }
   release(&cons.lock);
 
+  // copy the input bytes to the user-space buffer.
+  if(either_copyout(user_dst, dst, buf, target - n) == -1)
+    return -1;
+
   return target - n;
 }
 
@@ -11,9 +11,13 @@ struct superblock;
 
 // bio.c
 void            binit(void);
+int             bcachesize(void);
 struct buf*     bread(uint, uint);
+void            breadv(uint, uint*, uchar**, int);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwritev(struct buf**, int, uint);
+void            bprefetch(uint, uint*, int);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
 
@@ -34,6 +38,10 @@ int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
 
+// fdt.c
+void            fdtinit(uint64);
+int             bootopt(char*);
+
 // fs.c
 void            fsinit(int);
 int             dirlink(struct inode*, char*, uint);
@@ -49,6 +57,7 @@ void            iupdate(struct inode*);
 int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
+char*           ipage(struct inode*, uint);
 int             readi(struct inode*, int, uint64, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
@@ -62,6 +71,11 @@ void            ramdiskrw(struct buf*);
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit();
+void            kref(void *);
+int             krefcnt(void *);
+void*           kallocmega(void);
+void*           kalloc_zeroed(void);
+int             kzerofill(void);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -70,6 +84,14 @@ void            begin_op(int);
 void            end_op(int);
 void            crash_op(int,int);
 
+// pcache.c
+void            pcinit(void);
+char*           pclookup(uint, uint, uint);
+void            pcinsert(uint, uint, uint, char*);
+void            pcupdate(uint, uint, uint, char*, uint);
+void            pcinval(uint, uint);
+int             pcreclaim(int);
+
 // pipe.c
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
@@ -95,6 +117,10 @@ struct proc*    myproc();
 void            procinit(void);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
+void            schedtick(void);
+void            schedkick(void);
+int             setpriority(int, int);
+int             getpriority(int);
 void            setproc(struct proc*);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
@@ -111,6 +137,7 @@ void            swtch(struct context*, struct context*);
 // spinlock.c
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
+int             holdingany(void);
 void            initlock(struct spinlock*, char*);
 void            release(struct spinlock*);
 void            push_off(void);
@@ -132,6 +159,13 @@ int             strlen(const char*);
 int             strncmp(const char*, const char*, uint);
 char*           strncpy(char*, const char*, int);
 
+// swap.c
+void            swapinit(void);
+int             swapreclaim(void);
+char*           swapread(uint);
+void            swapdup(uint);
+void            swapfree(uint);
+
 // syscall.c
 int             argint(int, int*);
 int             argstr(int, char*, int);
@@ -140,9 +174,18 @@ int             fetchstr(uint64, char*, int);
 int             fetchaddr(uint64, uint64*);
 void            syscall();
 
+// timer.c
+void            timerinithart(void);
+uint64          timenow(void);
+int             timersleep(uint64);
+int             timerintr(void);
+void            timeridle(int);
+void            ipi(int);
+
 // trap.c
 extern uint     ticks;
 void            trapinit(void);
+void            clockintr(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
 void            usertrapret(void);
@@ -156,6 +199,7 @@ int             uartgetc(void);
 // vm.c
 void            kvminit(void);
 void            kvminithart(void);
+void            vmswitch(struct proc*);
 uint64          kvmpa(uint64);
 void            kvmmap(uint64, uint64, uint64, int);
 int             mappages(pagetable_t, uint64, uint64, uint64, int);
@@ -163,15 +207,36 @@ pagetable_t     uvmcreate(void);
 void            uvminit(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
-int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmcopy(pagetable_t, pagetable_t, uint64, uint64, int);
+int             uvmcow(pagetable_t, uint64);
+int             uvmlazy(pagetable_t, uint64, uint64, int);
+int             uvmswapin(pagetable_t, uint64);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
+pte_t*          walk(pagetable_t, uint64, int);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
 
+// copyuser.S
+int             copyuser(void*, void*, uint64);
+int             copyuserstr(char*, char*, uint64);
+
+// vma.c
+int             vmaadd(struct proc*, uint64, uint64, int, int, struct inode*, uint, uint);
+int             vmaunmap(struct proc*, uint64, uint64);
+void            vmafree(struct proc*);
+int             vmaprefork(struct proc*);
+int             vmadup(struct proc*, struct proc*);
+uint64          vmaend(struct proc*, uint64);
+uint64          vmabase(struct proc*, uint64);
+uint64          vmaprivate(struct proc*, uint64, uint64*);
+int             vmfault(struct proc*, uint64, int);
+int             vmmapped(struct proc*, uint64, uint64, int);
+int             vmtouch(struct proc*, uint64, uint64, int);
+
 // plic.c
 void            plicinit(void);
 void            plicinithart(void);
@@ -180,7 +245,12 @@ void            plic_complete(int);
 
 // virtio_disk.c
 void            virtio_disk_init(int);
+int             virtio_disk_present(int);
+uint64          virtio_disk_size(int);
 void            virtio_disk_rw(int, struct buf *, int);
+void            virtio_disk_submit(int, struct buf *, uint, int);
+void            virtio_disk_submitv(int, struct buf **, int, uint, int);
+void            virtio_disk_wait(int, struct buf *);
 void            virtio_disk_intr(int);
 
 // number of elements in fixed-size array
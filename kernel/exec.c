@@ -7,17 +7,30 @@
 #include "defs.h"
 #include "elf.h"
 
-static int loadseg(pde_t *pgdir, uint64 addr, struct inode *ip, uint offset, uint sz);
+// PTE permissions for a segment with ELF flags flags.
+static int
+flags2perm(int flags)
+{
+  int perm = PTE_R;
+  if(flags & ELF_PROG_FLAG_EXEC)
+    perm |= PTE_X;
+  if(flags & ELF_PROG_FLAG_WRITE)
+    perm |= PTE_W;
+  return perm;
+}
 
+// exec() reads only the ELF headers. The program's
+// segments become vmas, read in from ip page by page
+// as the program touches them; see vma.c.
 int
 exec(char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, off, nseg, locked;
   uint64 argc, sz, sp, ustack[MAXARG+1], stackbase;
   struct elfhdr elf;
   struct inode *ip;
-  struct proghdr ph;
+  struct proghdr ph, seg[NVMA];
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
 
@@ -28,6 +41,7 @@ exec(char *path, char **argv)
     return -1;
   }
   ilock(ip);
+  locked = 1;
 
   // Check ELF header
   if(readi(ip, 0, (uint64)&elf, 0, sizeof(elf)) != sizeof(elf))
@@ -38,8 +52,9 @@ exec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Find the program's segments.
   sz = 0;
+  nseg = 0;
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -49,16 +64,20 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto bad;
-    if((sz = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz)) == 0)
-      goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(ph.vaddr < sz || ph.vaddr + ph.memsz > HEAPTOP)
       goto bad;
+    if(ph.off + ph.filesz < ph.off)
+      goto bad;
+    if(nseg == NVMA)
+      goto bad;
+    seg[nseg++] = ph;
+    sz = ph.vaddr + ph.memsz;
   }
-  iunlockput(ip);
+  iunlock(ip);
   end_op(ROOTDEV);
-  ip = 0;
+  locked = 0;
 
   p = myproc();
   uint64 oldsz = p->sz;
@@ -66,6 +85,8 @@ exec(char *path, char **argv)
   // Allocate two pages at the next page boundary.
   // Use the second as the user stack.
   sz = PGROUNDUP(sz);
+  if(sz + 2*PGSIZE > HEAPTOP)
+    goto bad;
   if((sz = uvmalloc(pagetable, sz, sz + 2*PGSIZE)) == 0)
     goto bad;
   uvmclear(pagetable, sz-2*PGSIZE);
@@ -106,49 +127,36 @@ exec(char *path, char **argv)
   safestrcpy(p->name, last, sizeof(p->name));
     
   // Commit to the user image.
+  vmafree(p);
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
   p->sz = sz;
   p->tf->epc = elf.entry;  // initial program counter = main
   p->tf->sp = sp; // initial stack pointer
+  w_satp(MAKE_SATP(pagetable, p->asid));
+  sfence_vma_asid(p->asid);
   proc_freepagetable(oldpagetable, oldsz);
 
+  for(i = 0; i < nseg; i++)
+    vmaadd(p, seg[i].vaddr, seg[i].memsz, flags2perm(seg[i].flags), 0,
+           ip, seg[i].off, seg[i].filesz);
+  begin_op(ROOTDEV);
+  iput(ip);
+  end_op(ROOTDEV);
+
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
  bad:
   if(pagetable)
     proc_freepagetable(pagetable, sz);
   if(ip){
-    iunlockput(ip);
+    if(locked){
+      iunlockput(ip);
+    } else {
+      begin_op(ROOTDEV);
+      iput(ip);
+    }
     end_op(ROOTDEV);
   }
   return -1;
 }
-
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
-{
-  uint i, n;
-  uint64 pa;
-
-  if((va % PGSIZE) != 0)
-    panic("loadseg: va must be page aligned");
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
-      return -1;
-  }
-  
-  return 0;
-}
@@ -0,0 +1,106 @@
+// Boot arguments.
+//
+// qemu starts the kernel with the address of a flattened
+// device tree in a1, and puts the string given with -append
+// in the tree's /chosen node, as its bootargs property.
+// The tree sits near the top of RAM, which kinit() hands to
+// kalloc(), so start() has fdtinit() copy the string out
+// first.
+//
+// Interface:
+// * fdtinit() copies the boot arguments out of the tree.
+// * bootopt() says whether a word is among them.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define FDT_MAGIC      0xd00dfeed
+#define FDT_BEGIN_NODE 1
+#define FDT_END_NODE   2
+#define FDT_PROP       3
+#define FDT_NOP        4
+
+static char bootargs[128];
+
+// the tree is big-endian.
+static uint
+be32(uchar *p)
+{
+  return ((uint)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+// Copy /chosen/bootargs out of the device tree at dtb,
+// if there is one. Runs in machine mode, without paging.
+void
+fdtinit(uint64 dtb)
+{
+  uchar *fdt = (uchar*)dtb;
+  uchar *p, *end;
+  char *strings, *name;
+  uint len;
+  int depth = 0, chosen = 0;
+
+  if(dtb < KERNBASE || dtb + 40 > PHYSTOP || be32(fdt) != FDT_MAGIC)
+    return;
+  if(be32(fdt + 4) > PHYSTOP - dtb)
+    return;
+  end = fdt + be32(fdt + 4);
+  p = fdt + be32(fdt + 8);
+  strings = (char*)fdt + be32(fdt + 12);
+
+  while(p + 4 <= end){
+    switch(be32(p)){
+    case FDT_BEGIN_NODE:
+      // the root is at depth 1, and has no name.
+      name = (char*)p + 4;
+      depth++;
+      chosen = depth == 2 && strncmp(name, "chosen", 7) == 0;
+      p += 4 + ((strlen(name) + 1 + 3) & ~3);
+      break;
+    case FDT_END_NODE:
+      depth--;
+      chosen = 0;
+      p += 4;
+      break;
+    case FDT_PROP:
+      len = be32(p + 4);
+      name = strings + be32(p + 8);
+      if(chosen && strncmp(name, "bootargs", 9) == 0){
+        safestrcpy(bootargs, (char*)p + 12,
+                   len < sizeof(bootargs) ? len : sizeof(bootargs));
+        return;
+      }
+      p += 12 + ((len + 3) & ~3);
+      break;
+    case FDT_NOP:
+      p += 4;
+      break;
+    default:
+      // FDT_END, or not a tree after all.
+      return;
+    }
+  }
+}
+
+// Is opt one of the space-separated boot arguments?
+int
+bootopt(char *opt)
+{
+  char *s = bootargs;
+  int n = strlen(opt);
+
+  while(*s){
+    if(*s == ' '){
+      s++;
+      continue;
+    }
+    if(strncmp(s, opt, n) == 0 && (s[n] == ' ' || s[n] == 0))
+      return 1;
+    while(*s && *s != ' ')
+      s++;
+  }
+  return 0;
+}
@@ -106,7 +106,8 @@ filestat(struct file *f, uint64 addr)
 int
 fileread(struct file *f, uint64 addr, int n)
 {
-  int r = 0;
+  int r = 0, touched;
+  struct proc *p = myproc();
 
   if(f->readable == 0)
     return -1;
@@ -118,10 +119,17 @@ fileread(struct file *f, uint64 addr, int n)
       return -1;
     r = devsw[f->major].read(f, 1, addr, n);
   } else if(f->type == FD_INODE){
-    ilock(f->ip);
-    if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
-      f->off += r;
-    iunlock(f->ip);
+    // fault the buffer in before locking the inode, since a
+    // fault with it locked cannot read in a page of this file.
+    // if a page went away again before the copy got to it,
+    // and so the copy failed, go round again.
+    do {
+      touched = vmtouch(p, addr, n, PTE_W) == 0;
+      ilock(f->ip);
+      if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
+        f->off += r;
+      iunlock(f->ip);
+    } while(r < 0 && touched && !vmmapped(p, addr, n, PTE_W));
   } else {
     panic("fileread");
   }
@@ -134,7 +142,8 @@ fileread(struct file *f, uint64 addr, int n)
 int
 filewrite(struct file *f, uint64 addr, int n)
 {
-  int r, ret = 0;
+  int r, ret = 0, touched;
+  struct proc *p = myproc();
 
   if(f->writable == 0)
     return -1;
@@ -159,6 +168,8 @@ filewrite(struct file *f, uint64 addr, int n)
       if(n1 > max)
         n1 = max;
 
+      // as in fileread().
+      touched = vmtouch(p, addr + i, n1, PTE_R) == 0;
       begin_op(f->ip->dev);
       ilock(f->ip);
       if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
@@ -168,9 +179,11 @@ filewrite(struct file *f, uint64 addr, int n)
 
       if(r < 0)
         break;
-      if(r != n1)
-        panic("short filewrite");
       i += r;
+      // a short write with the rest of the buffer still there
+      // means a bad address, or a full disk.
+      if(r != n1 && (!touched || vmmapped(p, addr + i, n1 - r, PTE_R)))
+        break;
     }
     ret = (i == n ? n : -1);
   } else {
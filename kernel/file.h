@@ -21,13 +21,20 @@ struct inode {
   int ref;            // Reference count
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
+  uint ralast;        // last block readi() read, for read-ahead
+  uint ranext;        // next block to prefetch
+  uint rawin;         // read-ahead window, in blocks
+  uint indidx[NINDCACHE]; // recently used slots of the doubly-indirect block
+  uint indblk[NINDCACHE]; // and the indirect blocks they hold, 0 if none
+  int indnext;        // indblk[] entry to replace next
 
   short type;         // copy of disk inode
   short major;
   short minor;
+  short flags;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  uint addrs[NADDRS];
 };
 
 // map major device number to device functions.
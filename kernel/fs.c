@@ -22,6 +22,18 @@
 #include "file.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+
+// read-ahead window bounds, in blocks of a directory
+// or pages of a file.
+#define RA_MIN 2
+#define RA_MAX 8
+
+#define PGBLOCKS (PGSIZE / BSIZE)
+
+// free blocks a new extent looks for, so the file can grow into them.
+#define EXTENT_RUN 16
+
 static void itrunc(struct inode*);
 // there should be one superblock per disk device, but we run with
 // only one device
@@ -61,27 +73,65 @@ bzero(int dev, int bno)
 
 // Blocks.
 
-// Allocate a zeroed disk block.
+// Mark block b in use and zero it, if it is free.
+// Returns 1 if b was free.
+static int
+btake(uint dev, uint b)
+{
+  struct buf *bp;
+  int bi, m;
+
+  bp = bread(dev, BBLOCK(b, sb));
+  bi = b % BPB;
+  m = 1 << (bi % 8);
+  if(bp->data[bi/8] & m){
+    brelse(bp);
+    return 0;
+  }
+  bp->data[bi/8] |= m;
+  log_write(bp);
+  brelse(bp);
+  bzero(dev, b);
+  return 1;
+}
+
+// Allocate a zeroed disk block: goal, if it is free; else the
+// first block of the first run of want free blocks; else the
+// first free block. Extent files pass the block after their
+// last one as goal, so they grow contiguously.
 static uint
-balloc(uint dev)
+balloc(uint dev, uint goal, int want)
 {
-  int b, bi, m;
+  int b, bi, m, run;
   struct buf *bp;
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
+  if(goal > 0 && goal < sb.size && btake(dev, goal))
+    return goal;
+
+  for(;;){
+    for(b = 0; b < sb.size; b += BPB){
+      bp = bread(dev, BBLOCK(b, sb));
+      run = 0;
+      for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
+        m = 1 << (bi % 8);
+        if(bp->data[bi/8] & m){  // Is block in use?
+          run = 0;
+          continue;
+        }
+        if(++run == want){
+          bi -= want - 1;
+          bp->data[bi/8] |= 1 << (bi % 8);  // Mark block in use.
+          log_write(bp);
+          brelse(bp);
+          bzero(dev, b + bi);
+          return b + bi;
+        }
       }
+      brelse(bp);
     }
-    brelse(bp);
+    if(want == 1)
+      break;
+    want = 1;
   }
   panic("balloc: out of blocks");
 }
@@ -230,6 +280,7 @@ iupdate(struct inode *ip)
   dip->type = ip->type;
   dip->major = ip->major;
   dip->minor = ip->minor;
+  dip->flags = ip->flags;
   dip->nlink = ip->nlink;
   dip->size = ip->size;
   memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
@@ -268,6 +319,9 @@ iget(uint dev, uint inum)
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->ralast = 0;
+  ip->ranext = 0;
+  ip->rawin = 0;
   release(&icache.lock);
 
   return ip;
@@ -303,10 +357,12 @@ ilock(struct inode *ip)
     ip->type = dip->type;
     ip->major = dip->major;
     ip->minor = dip->minor;
+    ip->flags = dip->flags;
     ip->nlink = dip->nlink;
     ip->size = dip->size;
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
     brelse(bp);
+    memset(ip->indblk, 0, sizeof(ip->indblk));
     ip->valid = 1;
     if(ip->type == 0)
       panic("ilock: no type");
@@ -371,7 +427,95 @@ iunlockput(struct inode *ip)
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// listed in block ip->addrs[NDIRECT]. The next NDINDIRECT
+// blocks are listed in the NINDIRECT indirect blocks that
+// block ip->addrs[NDIRECT+1] lists. The inode remembers the
+// last NINDCACHE of those indirect blocks it used, so that
+// seeking around a big file costs one block read, not two.
+//
+// An I_EXTENT inode instead lists (start, length) runs of
+// blocks: NEXTENT in ip->addrs[], then NXEXTENT more in block
+// ip->addrs[NADDRS-1]. Finding a block takes no disk reads
+// for a file of up to NEXTENT runs, however long they are.
+
+// Return the disk block address of the nth block in extent
+// inode ip. writei() only ever adds the block just past the
+// end of the file; emap() allocates it right after the last
+// extent if that block is free, and starts a new extent
+// otherwise. Returns 0 if the file has run out of extents.
+static uint
+emap(struct inode *ip, uint bn)
+{
+  struct extent *e, *last;
+  struct buf *bp;
+  uint addr, base;
+  int i;
+
+  bp = 0;
+  e = last = 0;
+  base = 0;
+  for(i = 0; i < NEXTENT + NXEXTENT; i++){
+    if(i < NEXTENT){
+      e = (struct extent*)ip->addrs + i;
+    } else {
+      if(ip->addrs[NADDRS-1] == 0)
+        break;
+      if(bp == 0)
+        bp = bread(ip->dev, ip->addrs[NADDRS-1]);
+      e = (struct extent*)bp->data + (i - NEXTENT);
+    }
+    if(e->len == 0)
+      break;
+    if(bn < base + e->len){
+      addr = e->start + (bn - base);
+      if(bp)
+        brelse(bp);
+      return addr;
+    }
+    base += e->len;
+    last = e;
+  }
+  if(bn != base)
+    panic("emap: hole");
+
+  if(last){
+    addr = balloc(ip->dev, last->start + last->len, EXTENT_RUN);
+    if(addr == last->start + last->len){
+      last->len++;
+      if(i > NEXTENT)  // last is in the extent block
+        log_write(bp);
+      goto out;
+    }
+  } else {
+    addr = balloc(ip->dev, 0, EXTENT_RUN);
+  }
+
+  // start a new extent at slot i.
+  if(i == NEXTENT + NXEXTENT){
+    bfree(ip->dev, addr);
+    addr = 0;
+    goto out;
+  }
+  if(i < NEXTENT){
+    e = (struct extent*)ip->addrs + i;
+  } else {
+    if(bp == 0){
+      if(ip->addrs[NADDRS-1] == 0)
+        ip->addrs[NADDRS-1] = balloc(ip->dev, 0, 1);
+      bp = bread(ip->dev, ip->addrs[NADDRS-1]);
+    }
+    e = (struct extent*)bp->data + (i - NEXTENT);
+  }
+  e->start = addr;
+  e->len = 1;
+  if(i >= NEXTENT)
+    log_write(bp);
+
+out:
+  if(bp)
+    brelse(bp);
+  return addr;
+}
 
 // Return the disk block address of the nth block in inode ip.
 // If there is no such block, bmap allocates one.
@@ -380,10 +524,14 @@ bmap(struct inode *ip, uint bn)
 {
   uint addr, *a;
   struct buf *bp;
+  int i;
+
+  if(ip->flags & I_EXTENT)
+    return emap(ip, bn);
 
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
+      ip->addrs[bn] = addr = balloc(ip->dev, 0, 1);
     return addr;
   }
   bn -= NDIRECT;
@@ -391,11 +539,46 @@ bmap(struct inode *ip, uint bn)
   if(bn < NINDIRECT){
     // Load indirect block, allocating if necessary.
     if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
+      ip->addrs[NDIRECT] = addr = balloc(ip->dev, 0, 1);
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
     if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
+      a[bn] = addr = balloc(ip->dev, 0, 1);
+      log_write(bp);
+    }
+    brelse(bp);
+    return addr;
+  }
+
+  bn -= NINDIRECT;
+
+  if(bn < NDINDIRECT){
+    // Find the indirect block for bn, allocating if necessary.
+    addr = 0;
+    for(i = 0; i < NINDCACHE; i++){
+      if(ip->indblk[i] && ip->indidx[i] == bn / NINDIRECT){
+        addr = ip->indblk[i];
+        break;
+      }
+    }
+    if(addr == 0){
+      if((addr = ip->addrs[NDIRECT+1]) == 0)
+        ip->addrs[NDIRECT+1] = addr = balloc(ip->dev, 0, 1);
+      bp = bread(ip->dev, addr);
+      a = (uint*)bp->data;
+      if((addr = a[bn / NINDIRECT]) == 0){
+        a[bn / NINDIRECT] = addr = balloc(ip->dev, 0, 1);
+        log_write(bp);
+      }
+      brelse(bp);
+      ip->indidx[ip->indnext] = bn / NINDIRECT;
+      ip->indblk[ip->indnext] = addr;
+      ip->indnext = (ip->indnext + 1) % NINDCACHE;
+    }
+    bp = bread(ip->dev, addr);
+    a = (uint*)bp->data;
+    if((addr = a[bn % NINDIRECT]) == 0){
+      a[bn % NINDIRECT] = addr = balloc(ip->dev, 0, 1);
       log_write(bp);
     }
     brelse(bp);
@@ -405,6 +588,35 @@ bmap(struct inode *ip, uint bn)
   panic("bmap: out of range");
 }
 
+// Free the blocks of extent inode ip.
+static void
+etrunc(struct inode *ip)
+{
+  struct extent *e;
+  struct buf *bp;
+  int i;
+  uint b;
+
+  e = (struct extent*)ip->addrs;
+  for(i = 0; i < NEXTENT; i++){
+    for(b = 0; b < e[i].len; b++)
+      bfree(ip->dev, e[i].start + b);
+  }
+
+  if(ip->addrs[NADDRS-1]){
+    bp = bread(ip->dev, ip->addrs[NADDRS-1]);
+    e = (struct extent*)bp->data;
+    for(i = 0; i < NXEXTENT; i++){
+      for(b = 0; b < e[i].len; b++)
+        bfree(ip->dev, e[i].start + b);
+    }
+    brelse(bp);
+    bfree(ip->dev, ip->addrs[NADDRS-1]);
+  }
+
+  memset(ip->addrs, 0, sizeof(ip->addrs));
+}
+
 // Truncate inode (discard contents).
 // Only called when the inode has no links
 // to it (no directory entries referring to it)
@@ -414,8 +626,17 @@ static void
 itrunc(struct inode *ip)
 {
   int i, j;
-  struct buf *bp;
-  uint *a;
+  struct buf *bp, *bp2;
+  uint *a, *a2;
+
+  pcinval(ip->dev, ip->inum);
+
+  if(ip->flags & I_EXTENT){
+    etrunc(ip);
+    ip->size = 0;
+    iupdate(ip);
+    return;
+  }
 
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
@@ -436,6 +657,27 @@ itrunc(struct inode *ip)
     ip->addrs[NDIRECT] = 0;
   }
 
+  if(ip->addrs[NDIRECT+1]){
+    bp = bread(ip->dev, ip->addrs[NDIRECT+1]);
+    a = (uint*)bp->data;
+    for(i = 0; i < NINDIRECT; i++){
+      if(a[i] == 0)
+        continue;
+      bp2 = bread(ip->dev, a[i]);
+      a2 = (uint*)bp2->data;
+      for(j = 0; j < NINDIRECT; j++){
+        if(a2[j])
+          bfree(ip->dev, a2[j]);
+      }
+      brelse(bp2);
+      bfree(ip->dev, a[i]);
+    }
+    brelse(bp);
+    bfree(ip->dev, ip->addrs[NDIRECT+1]);
+    ip->addrs[NDIRECT+1] = 0;
+  }
+  memset(ip->indblk, 0, sizeof(ip->indblk));
+
   ip->size = 0;
   iupdate(ip);
 }
@@ -452,31 +694,166 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Note a read of blocks or pages first..last of ip, and
+// return how many more beyond last are worth reading now:
+// if the read continues where the last one left off, a
+// window that doubles on each sequential read, up to RA_MAX,
+// and collapses on a seek.
+// Caller must hold ip->lock.
+static uint
+rawindow(struct inode *ip, uint first, uint last)
+{
+  if(first == ip->ralast || first == ip->ralast + 1){
+    ip->rawin = ip->rawin ? min(2 * ip->rawin, RA_MAX) : RA_MIN;
+  } else {
+    ip->rawin = 0;
+    ip->ranext = 0;
+  }
+  ip->ralast = last;
+  return ip->rawin;
+}
+
+// Start reading blocks of directory ip that a read of blocks
+// first..last will want soon: the rest of first..last, and
+// the read-ahead window beyond last.
+// Caller must hold ip->lock.
+static void
+readahead(struct inode *ip, uint first, uint last)
+{
+  uint bn, end, blocks[RA_MAX];
+  int n;
+
+  end = min(last + 1 + rawindow(ip, first, last), (ip->size + BSIZE - 1) / BSIZE);
+  n = 0;
+  for(bn = max(ip->ranext, first + 1); bn < end; bn++){
+    blocks[n++] = bmap(ip, bn);
+    if(n == NELEM(blocks)){
+      bprefetch(ip->dev, blocks, n);
+      n = 0;
+    }
+  }
+  bprefetch(ip->dev, blocks, n);
+  ip->ranext = max(ip->ranext, bn);
+}
+
+// Return page pg of file ip, from the page cache or read in
+// and added to it, with a reference for the caller. Reading
+// it also reads up to ahead of the following pages that are
+// not cached, in the same disk requests. Bytes past the end
+// of the file read as zeros.
+// Returns 0 if memory is exhausted.
+// Caller must hold ip->lock.
+static char*
+fpage(struct inode *ip, uint pg, uint ahead)
+{
+  char *mem, *pages[1 + RA_MAX];
+  uchar *dst[(1 + RA_MAX) * PGBLOCKS];
+  uint bn, end, blocks[(1 + RA_MAX) * PGBLOCKS];
+  int i, np, nb;
+
+  if((mem = pclookup(ip->dev, ip->inum, pg * PGSIZE)) != 0)
+    return mem;
+
+  end = (ip->size + BSIZE - 1) / BSIZE;
+  ahead = min(ahead, RA_MAX);
+  nb = 0;
+  for(np = 0; np <= ahead && (pg + np) * PGBLOCKS < end; np++){
+    if(np > 0 && (mem = pclookup(ip->dev, ip->inum, (pg + np) * PGSIZE)) != 0){
+      kfree(mem);
+      break;
+    }
+    if((mem = kalloc()) == 0)
+      break;
+    memset(mem, 0, PGSIZE);
+    pages[np] = mem;
+    for(bn = (pg + np) * PGBLOCKS; bn < end && bn < (pg + np + 1) * PGBLOCKS; bn++){
+      blocks[nb] = bmap(ip, bn);
+      dst[nb++] = (uchar*)mem + (bn % PGBLOCKS) * BSIZE;
+    }
+  }
+  if(np == 0)
+    return 0;
+
+  breadv(ip->dev, blocks, dst, nb);
+  for(i = 0; i < np; i++){
+    pcinsert(ip->dev, ip->inum, (pg + i) * PGSIZE, pages[i]);
+    if(i > 0)
+      kfree(pages[i]);
+  }
+  return pages[0];
+}
+
+// Return the page of file ip that starts at off, with a
+// reference for the caller, for mapping into a process.
+// off need not be page-aligned; such pages are cached
+// as snapshots of the file.
+// Returns 0 if memory is exhausted.
+// Caller must hold ip->lock.
+char*
+ipage(struct inode *ip, uint off)
+{
+  char *mem;
+
+  if(off % PGSIZE == 0)
+    return fpage(ip, off / PGSIZE, 0);
+  if((mem = pclookup(ip->dev, ip->inum, off)) != 0)
+    return mem;
+  if((mem = kalloc()) == 0)
+    return 0;
+  memset(mem, 0, PGSIZE);
+  readi(ip, 0, (uint64)mem, off, PGSIZE);
+  pcinsert(ip->dev, ip->inum, off, mem);
+  return mem;
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
 // otherwise, dst is a kernel address.
+// A file's data comes from the page cache; a directory's
+// from the buffer cache.
 int
 readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, last, win;
   struct buf *bp;
+  char *pa;
 
   if(off > ip->size || off + n < off)
     return -1;
   if(off + n > ip->size)
     n = ip->size - off;
+  if(n == 0)
+    return 0;
 
+  if(ip->type == T_FILE){
+    last = (off + n - 1) / PGSIZE;
+    win = rawindow(ip, off / PGSIZE, last);
+    for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
+      if((pa = fpage(ip, off/PGSIZE, last - off/PGSIZE + win)) == 0)
+        return tot;
+      m = min(n - tot, PGSIZE - off%PGSIZE);
+      if(either_copyout(user_dst, dst, pa + (off % PGSIZE), m) == -1) {
+        kfree(pa);
+        return -1;
+      }
+      kfree(pa);
+    }
+    return tot;
+  }
+
+  readahead(ip, off/BSIZE, (off + n - 1)/BSIZE);
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
     bp = bread(ip->dev, bmap(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
       brelse(bp);
+      tot = -1;
       break;
     }
     brelse(bp);
   }
-  return n;
+  return tot;
 }
 
 // Write data to inode.
@@ -486,21 +863,25 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 int
 writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, addr;
   struct buf *bp;
 
   if(off > ip->size || off + n < off)
     return -1;
-  if(off + n > MAXFILE*BSIZE)
+  if(off + n > ((ip->flags & I_EXTENT) ? MAXEXTFILE : MAXFILE)*BSIZE)
     return -1;
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
+    if((addr = bmap(ip, off/BSIZE)) == 0)
+      break;
+    bp = bread(ip->dev, addr);
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
       brelse(bp);
       break;
     }
+    if(ip->type == T_FILE)
+      pcupdate(ip->dev, ip->inum, off, (char*)bp->data + (off % BSIZE), m);
     log_write(bp);
     brelse(bp);
   }
@@ -514,7 +895,7 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
     iupdate(ip);
   }
 
-  return n;
+  return tot;
 }
 
 // Directories
@@ -24,18 +24,36 @@ struct superblock {
 
 #define FSMAGIC 0x10203040
 
-#define NDIRECT 12
+#define NDIRECT 11
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define NDINDIRECT (NINDIRECT * NINDIRECT)
+#define MAXFILE (NDIRECT + NINDIRECT + NDINDIRECT)
+#define NADDRS (NDIRECT+2)  // block addresses in an inode
+
+// An extent inode keeps its blocks as runs of contiguous blocks
+// instead: NEXTENT extents in addrs[], and NXEXTENT more in the
+// block addrs[NADDRS-1].
+struct extent {
+  uint start;  // first block of the run
+  uint len;    // number of blocks in the run
+};
+
+#define NEXTENT ((NADDRS-1) * sizeof(uint) / sizeof(struct extent))
+#define NXEXTENT (BSIZE / sizeof(struct extent))
+#define MAXEXTFILE ((1U << 31) / BSIZE)  // keeps size in range
+
+// Inode flags
+#define I_EXTENT 0x1  // addrs[] holds extents
 
 // On-disk inode structure
 struct dinode {
   short type;           // File type
-  short major;          // Major device number (T_DEVICE only)
-  short minor;          // Minor device number (T_DEVICE only)
+  uchar major;          // Major device number (T_DEVICE only)
+  uchar minor;          // Minor device number (T_DEVICE only)
+  short flags;          // I_EXTENT
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  uint addrs[NADDRS];   // Data block addresses, or extents
 };
 
 // Inodes per block.
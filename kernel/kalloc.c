@@ -1,6 +1,33 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
 // and pipe buffers. Allocates whole 4096-byte pages.
+//
+// Each CPU keeps its own free list, so that kalloc() and
+// kfree() normally take a lock that no other CPU wants.
+// A CPU whose list grows past KMEM_HIGH pages hands
+// KMEM_BATCH of them back to a global pool. A CPU whose
+// list is empty refills KMEM_BATCH pages from the pool,
+// or, if the pool is empty too, steals half of another
+// CPU's list.
+//
+// Each page has a reference count, so that page tables can
+// share a page copy-on-write. kalloc() returns a page with
+// one reference, kref() adds one, and kfree() drops one,
+// freeing the page when none are left.
+//
+// The top 1/MEGAFRAC of memory is kept as a pool of
+// megapages, MEGASIZE-aligned runs of pages that a page
+// table can map with a single PTE. A megapage's pages are
+// counted and freed one by one like any others, and the
+// megapage goes back to the pool once all of them are free.
+// If kalloc() runs out of pages, it breaks a free megapage
+// up into ordinary pages.
+//
+// Most new pages are wanted full of zeros: page-table pages,
+// and process memory. Idle CPUs zero free pages ahead of
+// time, up to KZERO_MAX of them, into a pool from which
+// kalloc_zeroed() takes them, so that a page fault or fork()
+// need not clear a page itself.
 
 #include "types.h"
 #include "param.h"
@@ -9,6 +36,13 @@
 #include "riscv.h"
 #include "defs.h"
 
+#define KMEM_BATCH 32               // pages moved to/from the pool at once
+#define KMEM_HIGH  (4*KMEM_BATCH)   // drain a CPU's list above this
+#define KZERO_MAX  512              // most pages kept zeroed
+
+#define PA2REF(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+#define PA2MEGA(pa) (((uint64)(pa) - KERNBASE) / MEGASIZE)
+
 void freerange(void *pa_start, void *pa_end);
 
 extern char end[]; // first address after kernel.
@@ -18,16 +52,47 @@ struct run {
   struct run *next;
 };
 
-struct {
+struct kmem {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+  int nfree;
+};
+
+struct kmem kmem[NCPU];  // per-CPU free lists
+struct kmem kpool;       // global pool shared by all CPUs
+struct kmem kzero;       // zeroed pages, for kalloc_zeroed()
+
+// references to each physical page, updated with atomic
+// instructions rather than under a lock.
+int pgref[PA2REF(PHYSTOP)];
+
+struct {
+  struct spinlock lock;
+  struct run *freelist;           // free megapages
+  char inpool[PA2MEGA(PHYSTOP)];  // is the megapage in the pool?
+  short nused[PA2MEGA(PHYSTOP)];  // its pages in use
+} kmega;
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
-  freerange(end, (void*)PHYSTOP);
+  uint64 top, pa;
+
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmem[i].lock, "kmem");
+  initlock(&kpool.lock, "kmem_pool");
+  initlock(&kzero.lock, "kmem_zero");
+  initlock(&kmega.lock, "kmem_mega");
+
+  top = MEGAROUNDUP(PHYSTOP - (PHYSTOP - KERNBASE) / MEGAFRAC);
+  if(top < MEGAROUNDUP((uint64)end))
+    top = MEGAROUNDUP((uint64)end);
+  freerange(end, (void*)top);
+  for(pa = top; pa < PHYSTOP; pa += MEGASIZE){
+    kmega.inpool[PA2MEGA(pa)] = 1;
+    ((struct run*)pa)->next = kmega.freelist;
+    kmega.freelist = (struct run*)pa;
+  }
 }
 
 void
@@ -35,31 +100,170 @@ freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
+  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE){
+    pgref[PA2REF(p)] = 1;
     kfree(p);
+  }
+}
+
+// Detach up to n pages from k's free list, or half of
+// the list if n is 0. Returns them as a null-terminated
+// chain and sets *np to how many there are.
+static struct run*
+takepages(struct kmem *k, int n, int *np)
+{
+  struct run *head, *r;
+  int i;
+
+  acquire(&k->lock);
+  if(n == 0)
+    n = (k->nfree + 1) / 2;
+  head = k->freelist;
+  r = 0;
+  for(i = 0; i < n && k->freelist; i++){
+    r = k->freelist;
+    k->freelist = r->next;
+  }
+  if(r)
+    r->next = 0;
+  else
+    head = 0;
+  k->nfree -= i;
+  release(&k->lock);
+
+  *np = i;
+  return head;
+}
+
+// Splice a chain of n pages onto k's free list.
+static void
+putpages(struct kmem *k, struct run *head, int n)
+{
+  struct run *tail;
+
+  if(head == 0)
+    return;
+  for(tail = head; tail->next; tail = tail->next)
+    ;
+  acquire(&k->lock);
+  tail->next = k->freelist;
+  k->freelist = head;
+  k->nfree += n;
+  release(&k->lock);
+}
+
+// Find a page for CPU id once its own list has run dry:
+// refill a batch from the pool, else steal from another
+// CPU, else fall back on the zeroed pages. Keeps one page
+// for the caller and moves the rest onto CPU id's list.
+// Returns 0 if memory is exhausted.
+static struct run*
+refill(int id)
+{
+  struct run *r;
+  int i, n;
+
+  r = takepages(&kpool, KMEM_BATCH, &n);
+  for(i = 1; r == 0 && i < NCPU; i++)
+    r = takepages(&kmem[(id + i) % NCPU], 0, &n);
+  if(r == 0)
+    r = takepages(&kzero, KMEM_BATCH, &n);
+  if(r == 0)
+    return 0;
+  putpages(&kmem[id], r->next, n - 1);
+  return r;
+}
+
+// Add a reference to the page of physical memory pointed
+// at by pa, which must already have one.
+void
+kref(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kref");
+  if(__sync_fetch_and_add(&pgref[PA2REF(pa)], 1) < 1)
+    panic("kref: free page");
+}
+
+// Return how many references the page at pa has.
+int
+krefcnt(void *pa)
+{
+  return pgref[PA2REF(pa)];
 }
 
-// Free the page of physical memory pointed at by v,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Drop a reference to the page of physical memory pointed
+// at by pa, which normally should have been returned by a
+// call to kalloc(), and free it if that was the last one.
+// (The exception is when initializing the allocator; see
+// kinit above.)
 void
 kfree(void *pa)
 {
-  struct run *r;
+  struct run *r, *batch;
+  struct kmem *k;
+  int n;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  if((n = __sync_sub_and_fetch(&pgref[PA2REF(pa)], 1)) > 0)
+    return;
+  if(n < 0)
+    panic("kfree: free page");
+
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
 
+  if(kmega.inpool[PA2MEGA(pa)]){
+    // the megapage is free once all its pages are.
+    r = (struct run*)MEGAROUNDDOWN((uint64)pa);
+    acquire(&kmega.lock);
+    if(--kmega.nused[PA2MEGA(pa)] == 0){
+      r->next = kmega.freelist;
+      kmega.freelist = r;
+    }
+    release(&kmega.lock);
+    return;
+  }
+
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  k = &kmem[cpuid()];
+  acquire(&k->lock);
+  r->next = k->freelist;
+  k->freelist = r;
+  k->nfree++;
+  n = k->nfree;
+  release(&k->lock);
+
+  // Give a batch back to the pool so that other CPUs
+  // can find it without stealing.
+  if(n > KMEM_HIGH){
+    batch = takepages(k, KMEM_BATCH, &n);
+    putpages(&kpool, batch, n);
+  }
+  pop_off();
+}
+
+// Turn a free megapage from the pool into ordinary pages.
+// Returns 1 on success, 0 if the pool has none free.
+static int
+megabreak(void)
+{
+  struct run *r;
+
+  acquire(&kmega.lock);
+  if((r = kmega.freelist) != 0){
+    kmega.freelist = r->next;
+    kmega.inpool[PA2MEGA(r)] = 0;
+  }
+  release(&kmega.lock);
+  if(r == 0)
+    return 0;
+  freerange(r, (char*)r + MEGASIZE);
+  return 1;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -69,14 +273,98 @@ void *
 kalloc(void)
 {
   struct run *r;
+  struct kmem *k;
+  int id;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  push_off();
+  id = cpuid();
+  k = &kmem[id];
+  acquire(&k->lock);
+  r = k->freelist;
+  if(r){
+    k->freelist = r->next;
+    k->nfree--;
+  }
+  release(&k->lock);
 
-  if(r)
+  if(r == 0)
+    r = refill(id);
+  pop_off();
+
+  // out of memory: free cached file pages that no process
+  // maps, or break up a megapage.
+  if(r == 0 && (pcreclaim(KMEM_BATCH) > 0 || megabreak()))
+    return kalloc();
+
+  if(r){
     memset((char*)r, 5, PGSIZE); // fill with junk
+    pgref[PA2REF(r)] = 1;
+  }
+  return (void*)r;
+}
+
+// Allocate one page of physical memory, filled with zeros.
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_zeroed(void)
+{
+  struct run *r;
+  int n;
+
+  // takepages() clears the link in the page's first word.
+  if((r = takepages(&kzero, 1, &n)) != 0){
+    pgref[PA2REF(r)] = 1;
+    return (void*)r;
+  }
+  if((r = kalloc()) != 0)
+    memset((char*)r, 0, PGSIZE);
+  return (void*)r;
+}
+
+// Zero a free page for kalloc_zeroed(), if the zeroed pool
+// is not full. Called by an idle CPU's scheduler() instead
+// of waiting for an interrupt. Takes only pages from this
+// CPU's list or the global pool, never another CPU's.
+// Returns 1 if it zeroed a page, 0 if there was no need
+// or no free page.
+int
+kzerofill(void)
+{
+  struct run *r;
+  int n;
+
+  if(kzero.nfree >= KZERO_MAX)
+    return 0;
+  push_off();
+  if((r = takepages(&kmem[cpuid()], 1, &n)) == 0)
+    r = takepages(&kpool, 1, &n);
+  pop_off();
+  if(r == 0)
+    return 0;
+  memset((char*)r, 0, PGSIZE);
+  putpages(&kzero, r, 1);
+  return 1;
+}
+
+// Allocate a megapage: MEGASIZE bytes of physical memory,
+// MEGASIZE-aligned, as pages with one reference each,
+// which kfree() frees one at a time.
+// Returns 0 if the pool has no megapage free.
+void *
+kallocmega(void)
+{
+  struct run *r;
+  int i;
+
+  acquire(&kmega.lock);
+  if((r = kmega.freelist) != 0){
+    kmega.freelist = r->next;
+    kmega.nused[PA2MEGA(r)] = MEGASIZE / PGSIZE;
+  }
+  release(&kmega.lock);
+  if(r){
+    for(i = 0; i < MEGASIZE / PGSIZE; i++)
+      pgref[PA2REF((char*)r + i*PGSIZE)] = 1;
+  }
   return (void*)r;
 }
@@ -10,16 +10,26 @@
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
+// calls. A transaction is closed to new system calls only
+// when none of its system calls are active. Thus there is never
 // any reasoning required about whether a commit might
 // write an uncommitted system call's updates to disk.
 //
+// The log is double-buffered: while one closed transaction
+// is being written to disk, the next one collects new system
+// calls. Closing copies the transaction's blocks aside, so
+// that the next transaction can go on changing them in the
+// buffer cache. A transaction closes when its last system
+// call ends and no commit is under way; when it is about to
+// outgrow the log; or when it has been open for COMMITTICKS.
+// So under a steady stream of writers, each commit carries
+// everything that arrived while the previous one was written.
+//
 // A system call should call begin_op()/end_op() to mark
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
-// But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// But if the open transaction is closing, it sleeps until
+// the transaction's last outstanding end_op() has closed it.
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
@@ -28,23 +38,37 @@
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// Log appends are synchronous, but the blocks of one append
+// go to the disk together.
+//
+// The log uses as much of the on-disk log area as one header
+// block can describe, so a bigger file system log gives bigger
+// transactions without recompiling the kernel.
+
+#define COMMITTICKS 1  // close a transaction this long after its first write
+#define LOGMAX (BSIZE / sizeof(int) - 1)  // most blocks one header can name
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
 struct logheader {
   int n;
-  int block[LOGSIZE];
+  int block[LOGMAX];
 };
 
 struct log {
   struct spinlock lock;
   int start;
-  int size;
+  int size;        // log data blocks in use, at most LOGMAX
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int closing;     // open transaction takes no new sys calls.
+  int committing;  // in commit(), writing a closed transaction.
+  uint opened;     // ticks at the open transaction's first write.
   int dev;
-  struct logheader lh;
+  struct logheader lh;   // open transaction
+  struct logheader clh;  // closed transaction, being committed
+  struct buf *pinned[LOGMAX];  // clh's blocks in the buffer cache
+  struct buf shadow[LOGMAX];   // copies of clh's blocks, as closed
+  struct buf *bp[LOGMAX];      // clh's blocks, as handed to bwritev()
 };
 struct log log[NDISK];
 
@@ -54,30 +78,65 @@ static void commit(int);
 void
 initlog(int dev, struct superblock *sb)
 {
-  if (sizeof(struct logheader) >= BSIZE)
+  uchar *data = 0;
+
+  if (sizeof(struct logheader) > BSIZE)
     panic("initlog: too big logheader");
 
   initlock(&log[dev].lock, "log");
   log[dev].start = sb->logstart;
-  log[dev].size = sb->nlog;
+  // the first log block is the header.
+  log[dev].size = sb->nlog - 1;
+  if (log[dev].size > LOGMAX)
+    log[dev].size = LOGMAX;
+  // the closed transaction keeps its blocks pinned in the
+  // buffer cache until they are installed, and the open one
+  // pins its own meanwhile; leave LOGSIZE buffers for the rest.
+  if (log[dev].size > (bcachesize() - LOGSIZE) / 2)
+    log[dev].size = (bcachesize() - LOGSIZE) / 2;
+  if (log[dev].size < MAXOPBLOCKS)
+    panic("initlog: log too small");
+  for (int i = 0; i < log[dev].size; i++) {
+    if (i % (PGSIZE / BSIZE) == 0 && (data = kalloc()) == 0)
+      panic("initlog: kalloc");
+    log[dev].shadow[i].data = data + (i % (PGSIZE / BSIZE)) * BSIZE;
+    initsleeplock(&log[dev].shadow[i].lock, "log shadow");
+  }
   log[dev].dev = dev;
   recover_from_log(dev);
 }
 
-// Copy committed blocks from log to their home location
+// Copy committed blocks from log to their home location.
+// After a commit the blocks are in the shadow buffers, so
+// only recovery needs to read them back from the log.
+// The writes go to the disk together, adjacent blocks merged.
 static void
-install_trans(int dev)
+install_trans(int dev, int recovering)
 {
+  struct buf **bp = log[dev].bp;
   int tail;
 
-  for (tail = 0; tail < log[dev].lh.n; tail++) {
-    struct buf *lbuf = bread(dev, log[dev].start+tail+1); // read log block
-    struct buf *dbuf = bread(dev, log[dev].lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+  for (tail = 0; tail < log[dev].clh.n; tail++) {
+    if(recovering){
+      struct buf *lbuf = bread(dev, log[dev].start+tail+1); // read log block
+      struct buf *dbuf = bread(dev, log[dev].clh.block[tail]); // read dst
+      memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
+      brelse(lbuf);
+      bp[tail] = dbuf;
+    } else {
+      bp[tail] = &log[dev].shadow[tail];
+    }
+  }
+  bwritev(bp, log[dev].clh.n, 0);  // write dsts to disk
+  for (tail = 0; tail < log[dev].clh.n; tail++) {
+    if(recovering){
+      brelse(bp[tail]);
+    } else {
+      // the home block is on disk, so the cache may drop it,
+      // unless the open transaction has pinned it again.
+      bunpin(log[dev].pinned[tail]);
+      releasesleep(&log[dev].shadow[tail].lock);
+    }
   }
 }
 
@@ -88,9 +147,9 @@ read_head(int dev)
   struct buf *buf = bread(dev, log[dev].start);
   struct logheader *lh = (struct logheader *) (buf->data);
   int i;
-  log[dev].lh.n = lh->n;
-  for (i = 0; i < log[dev].lh.n; i++) {
-    log[dev].lh.block[i] = lh->block[i];
+  log[dev].clh.n = lh->n;
+  for (i = 0; i < log[dev].clh.n; i++) {
+    log[dev].clh.block[i] = lh->block[i];
   }
   brelse(buf);
 }
@@ -104,9 +163,9 @@ write_head(int dev)
   struct buf *buf = bread(dev, log[dev].start);
   struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  hb->n = log[dev].lh.n;
-  for (i = 0; i < log[dev].lh.n; i++) {
-    hb->block[i] = log[dev].lh.block[i];
+  hb->n = log[dev].clh.n;
+  for (i = 0; i < log[dev].clh.n; i++) {
+    hb->block[i] = log[dev].clh.block[i];
   }
   bwrite(buf);
   brelse(buf);
@@ -116,8 +175,8 @@ static void
 recover_from_log(int dev)
 {
   read_head(dev);
-  install_trans(dev); // if committed, copy from log to disk
-  log[dev].lh.n = 0;
+  install_trans(dev, 1); // if committed, copy from log to disk
+  log[dev].clh.n = 0;
   write_head(dev); // clear the log
 }
 
@@ -127,10 +186,14 @@ begin_op(int dev)
 {
   acquire(&log[dev].lock);
   while(1){
-    if(log[dev].committing){
+    if(log[dev].closing){
       sleep(&log, &log[dev].lock);
-    } else if(log[dev].lh.n + (log[dev].outstanding+1)*MAXOPBLOCKS > LOGSIZE){
-      // this op might exhaust log space; wait for commit.
+    } else if(log[dev].lh.n + (log[dev].outstanding+1)*MAXOPBLOCKS > log[dev].size ||
+              (log[dev].lh.n > 0 && ticks - log[dev].opened >= COMMITTICKS)){
+      // this op might exhaust log space, or the open transaction
+      // has collected writers long enough; close it and wait
+      // for the next one.
+      log[dev].closing = 1;
       sleep(&log, &log[dev].lock);
     } else {
       log[dev].outstanding += 1;
@@ -141,7 +204,9 @@ begin_op(int dev)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// commits if this was the last outstanding operation,
+// unless a commit is already under way, in which case
+// that commit() will pick up this transaction when done.
 void
 end_op(int dev)
 {
@@ -149,9 +214,7 @@ end_op(int dev)
 
   acquire(&log[dev].lock);
   log[dev].outstanding -= 1;
-  if(log[dev].committing)
-    panic("log[dev].committing");
-  if(log[dev].outstanding == 0){
+  if(log[dev].outstanding == 0 && !log[dev].committing){
     do_commit = 1;
     log[dev].committing = 1;
   } else {
@@ -166,39 +229,81 @@ end_op(int dev)
     // call commit w/o holding locks, since not allowed
     // to sleep with locks.
     commit(dev);
-    acquire(&log[dev].lock);
-    log[dev].committing = 0;
-    wakeup(&log);
-    release(&log[dev].lock);
   }
 }
 
-// Copy modified blocks from cache to log.
+// Close the open transaction, which has no outstanding
+// sys calls: copy its blocks, as they are now, into the
+// shadow buffers, and make it the committing transaction.
+// Caller holds log.lock, and has set log.closing to keep
+// new sys calls out until this returns.
+static void
+close_trans(int dev)
+{
+  struct buf *b;
+  int tail;
+
+  log[dev].clh = log[dev].lh;
+  log[dev].lh.n = 0;
+  release(&log[dev].lock);
+
+  for (tail = 0; tail < log[dev].clh.n; tail++) {
+    b = bread(dev, log[dev].clh.block[tail]); // cache block
+    acquiresleep(&log[dev].shadow[tail].lock);
+    log[dev].shadow[tail].dev = dev;
+    log[dev].shadow[tail].blockno = b->blockno;
+    memmove(log[dev].shadow[tail].data, b->data, BSIZE);
+    log[dev].pinned[tail] = b;
+    brelse(b);
+  }
+
+  acquire(&log[dev].lock);
+}
+
+// Write the closed transaction's blocks to the log.
+// The log slots are contiguous, so the blocks go into
+// them in as few disk requests as possible.
 static void
 write_log(int dev)
 {
+  struct buf **bp = log[dev].bp;
   int tail;
 
-  for (tail = 0; tail < log[dev].lh.n; tail++) {
-    struct buf *to = bread(dev, log[dev].start+tail+1); // log block
-    struct buf *from = bread(dev, log[dev].lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  for (tail = 0; tail < log[dev].clh.n; tail++) {
+    bp[tail] = &log[dev].shadow[tail];
   }
+  bwritev(bp, log[dev].clh.n, log[dev].start+1);  // write the log
 }
 
+// Commit the open transaction, then any transaction that
+// became ready while that one was being written.
+// Caller has set log.committing; commit() clears it.
 static void
 commit(int dev)
 {
-  if (log[dev].lh.n > 0) {
-    write_log(dev);     // Write modified blocks from cache to log
+  acquire(&log[dev].lock);
+  while(log[dev].outstanding == 0 && log[dev].lh.n > 0){
+    log[dev].closing = 1;
+    close_trans(dev);
+    log[dev].closing = 0;
+    wakeup(&log);
+    release(&log[dev].lock);
+
+    write_log(dev);     // Write closed transaction's blocks to log
     write_head(dev);    // Write header to disk -- the real commit
-    install_trans(dev); // Now install writes to home locations
-    log[dev].lh.n = 0;
+    install_trans(dev, 0); // Now install writes to home locations
+    log[dev].clh.n = 0;
     write_head(dev);    // Erase the transaction from the log
+
+    acquire(&log[dev].lock);
   }
+  // a transaction that closed for space with sys calls still
+  // outstanding stays closed; its last end_op() commits it.
+  if(log[dev].outstanding == 0)
+    log[dev].closing = 0;
+  log[dev].committing = 0;
+  wakeup(&log);
+  release(&log[dev].lock);
 }
 
 // Caller has modified b->data and is done with the buffer.
@@ -216,7 +321,7 @@ log_write(struct buf *b)
   int i;
 
   int dev = b->dev;
-  if (log[dev].lh.n >= LOGSIZE || log[dev].lh.n >= log[dev].size - 1)
+  if (log[dev].lh.n >= log[dev].size)
     panic("too big a transaction");
   if (log[dev].outstanding < 1)
     panic("log_write outside of trans");
@@ -228,10 +333,11 @@ log_write(struct buf *b)
   }
   log[dev].lh.block[i] = b->blockno;
   if (i == log[dev].lh.n) {  // Add new block to log?
+    if (i == 0)
+      log[dev].opened = ticks;
     bpin(b);
     log[dev].lh.n++;
   }
   release(&log[dev].lock);
 }
 
-
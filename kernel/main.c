@@ -26,12 +26,15 @@ main()
     procinit();      // process table
     trapinit();      // trap vectors
     trapinithart();  // install kernel trap vector
+    timerinithart(); // clock tick and timer wheel
     plicinit();      // set up interrupt controller
     plicinithart();  // ask PLIC for device interrupts
     binit();         // buffer cache
+    pcinit();        // page cache
     iinit();         // inode cache
     fileinit();      // file table
     virtio_disk_init(minor(ROOTDEV)); // emulated hard disk
+    swapinit();      // swap disk, if there is one
     userinit();      // first user process
     __sync_synchronize();
     started = 1;
@@ -42,6 +45,7 @@ main()
     printf("hart %d starting\n", cpuid());
     kvminithart();    // turn on paging
     trapinithart();   // install kernel trap vector
+    timerinithart();  // clock tick and timer wheel
     plicinithart();   // ask PLIC for device interrupts
   }
 
@@ -28,8 +28,10 @@
 
 // local interrupt controller, which contains the timer.
 #define CLINT 0x2000000L
+#define CLINT_MSIP(hartid) (CLINT + 4*(hartid))
 #define CLINT_MTIMECMP(hartid) (CLINT + 0x4000 + 8*(hartid))
 #define CLINT_MTIME (CLINT + 0xBFF8) // cycles since boot.
+#define CLINT_HZ 10000000L  // rate of CLINT_MTIME in qemu.
 
 // qemu puts programmable interrupt controller here.
 #define PLIC 0x0c000000L
@@ -42,6 +44,13 @@
 #define PLIC_MCLAIM(hart) (PLIC + 0x200004 + (hart)*0x2000)
 #define PLIC_SCLAIM(hart) (PLIC + 0x201004 + (hart)*0x2000)
 
+// the kernel maps the CLINT just above the PLIC, since a
+// process's heap may cover the CLINT's physical address.
+#define CLINTVA (PLIC + 0x400000)
+#define CLINTVA_MSIP(hartid) (CLINTVA + 4*(hartid))
+#define CLINTVA_MTIMECMP(hartid) (CLINTVA + 0x4000 + 8*(hartid))
+#define CLINTVA_MTIME (CLINTVA + 0xBFF8)
+
 // the kernel expects there to be RAM
 // for use by the kernel and user pages
 // from physical address 0x80000000 to PHYSTOP.
@@ -61,8 +70,17 @@
 //   text
 //   original data and bss
 //   fixed-size stack
-//   expandable heap
+//   expandable heap, up to HEAPTOP
+//   ...
+//   the kernel's devices and RAM
 //   ...
+//   mmap()ed memory, from USERTOP down to MMAPBASE
+//   the process's kernel stack
 //   TRAPFRAME (p->tf, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
+// Each process's page table maps the kernel too, without
+// PTE_U, so user memory must stay clear of the kernel's.
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+#define HEAPTOP PLIC
+#define MMAPBASE (1L << 32)
+#define USERTOP (MAXVA - MEGASIZE)
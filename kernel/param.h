@@ -1,14 +1,24 @@
 #define NPROC        10  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
+#define NPRIO         3  // MLFQ scheduler priority levels
+#define BOOSTTICKS   20  // ticks between MLFQ priority boosts
+#define TICKHZ       10  // clock ticks per second
 #define NOFILE       16  // open files per process
+#define NVMA         16  // file-backed memory ranges per process
 #define NFILE       100  // open files per system
 #define NINODE       50  // maximum number of active i-nodes
+#define NINDCACHE     4  // indirect blocks remembered per active i-node
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       0  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       2000  // size of file system in blocks
+#define NBUF         (LOGSIZE*5)  // minimum size of disk block cache
+#define BCACHEFRAC   16  // disk block cache gets 1/BCACHEFRAC of RAM
+#define NPCACHE    4096  // file pages in the page cache
+#define MEGAFRAC      8  // 1/MEGAFRAC of RAM is kept as megapages
+#define SWAPDEV       1  // device number of the swap disk
+#define NSWAP     16384  // most pages the swap disk holds
+#define FSSIZE       200000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
 #define NDISK        2
@@ -0,0 +1,247 @@
+// Page cache.
+//
+// The page cache holds file data in whole pages, keyed by
+// (dev, inum, offset), so that the buffer cache need only
+// hold metadata and the blocks a transaction is writing.
+// readi() copies file data out of the page cache, and the
+// page fault handler maps its pages straight into processes
+// that run a program or map a file privately, read-only and
+// copy-on-write if the memory is writable.
+//
+// A page at a page-aligned offset mirrors the file: writei()
+// updates it along with the disk. If a process maps it, the
+// cache moves to a fresh copy first, so that the process
+// keeps the contents it mapped. exec() maps segments that
+// need not start on a page boundary, so the cache also holds
+// pages of a file at unaligned offsets; these are snapshots,
+// and a write to the bytes they hold drops them.
+//
+// The cache holds a reference to each of its pages. A page
+// that only the cache refers to is freed when its slot is
+// wanted or when kalloc() runs out of memory.
+//
+// Interface:
+// * pclookup() finds a page; pcinsert() adds one.
+// * pcupdate() copies a write to a file into its pages,
+//     first copying a page that a process maps.
+// * pcinval() drops all of a file's pages.
+// * pcreclaim() frees unused pages for kalloc().
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "defs.h"
+
+#define NPCBUCKET 1021
+#define PCHASH(dev, inum, off) \
+  ((((dev) * 31 + (inum)) * 131 + (off) / PGSIZE) % NPCBUCKET)
+
+struct cpage {
+  uint dev;
+  uint inum;
+  uint off;            // offset of the page in the file
+  char *pa;            // the page; 0 if the slot is free
+  struct cpage *next;  // hash bucket chain, or free list
+};
+
+struct {
+  struct spinlock lock;
+  struct cpage page[NPCACHE];
+  struct cpage *bucket[NPCBUCKET];
+  struct cpage *free;  // unused slots
+  struct cpage *hand;  // clock hand for eviction
+} pcache;
+
+void
+pcinit(void)
+{
+  struct cpage *c;
+
+  initlock(&pcache.lock, "pcache");
+  for(c = pcache.page; c < &pcache.page[NPCACHE]; c++){
+    c->next = pcache.free;
+    pcache.free = c;
+  }
+  pcache.hand = pcache.page;
+}
+
+// Remove c from its hash chain, free its page, and put
+// it on the free list. Caller holds pcache.lock.
+static void
+pcdrop(struct cpage *c)
+{
+  struct cpage **pp;
+
+  for(pp = &pcache.bucket[PCHASH(c->dev, c->inum, c->off)]; *pp != c; pp = &(*pp)->next)
+    ;
+  *pp = c->next;
+  kfree(c->pa);
+  c->pa = 0;
+  c->next = pcache.free;
+  pcache.free = c;
+}
+
+// Return the slot of (dev, inum) at off, or 0.
+// Caller holds pcache.lock.
+static struct cpage*
+pcfind(uint dev, uint inum, uint off)
+{
+  struct cpage *c;
+
+  for(c = pcache.bucket[PCHASH(dev, inum, off)]; c; c = c->next){
+    if(c->dev == dev && c->inum == inum && c->off == off)
+      return c;
+  }
+  return 0;
+}
+
+// Return the cached page of (dev, inum) at off, with a
+// reference for the caller, or 0 if it is not cached.
+char*
+pclookup(uint dev, uint inum, uint off)
+{
+  struct cpage *c;
+  char *pa = 0;
+
+  acquire(&pcache.lock);
+  if((c = pcfind(dev, inum, off)) != 0){
+    kref(c->pa);
+    pa = c->pa;
+  }
+  release(&pcache.lock);
+  return pa;
+}
+
+// Add page pa as the page of (dev, inum) at off. The cache
+// takes its own reference, and the caller keeps its own.
+// If every slot holds a page that is in use, pa is simply
+// not cached. Caller must hold the inode's lock, so that
+// nobody else can add the same page meanwhile.
+void
+pcinsert(uint dev, uint inum, uint off, char *pa)
+{
+  struct cpage *c;
+  int i;
+
+  acquire(&pcache.lock);
+  if(pcache.free == 0){
+    // evict the next page, clockwise, that nobody maps.
+    for(i = 0; i < NPCACHE; i++){
+      c = pcache.hand;
+      if(++pcache.hand == &pcache.page[NPCACHE])
+        pcache.hand = pcache.page;
+      if(krefcnt(c->pa) == 1){
+        pcdrop(c);
+        break;
+      }
+    }
+  }
+  if((c = pcache.free) != 0){
+    pcache.free = c->next;
+    c->dev = dev;
+    c->inum = inum;
+    c->off = off;
+    c->pa = pa;
+    kref(pa);
+    c->next = pcache.bucket[PCHASH(dev, inum, off)];
+    pcache.bucket[PCHASH(dev, inum, off)] = c;
+  }
+  release(&pcache.lock);
+}
+
+// n bytes at src were just written to (dev, inum) at off,
+// within one page. Copy them into the cached page, and drop
+// the unaligned pages that hold any of them. Processes that
+// map an unaligned page keep their snapshot.
+// A process may map the aligned page too, read-only or
+// copy-on-write, and must not see the write, so a page that
+// is not the cache's alone is replaced by a fresh copy, or
+// dropped if there is no memory for one.
+// Caller must hold the inode's lock.
+void
+pcupdate(uint dev, uint inum, uint off, char *src, uint n)
+{
+  struct cpage *c, *next;
+  uint pg = PGROUNDDOWN(off);
+  char *mem;
+  int i, mapped;
+
+  // kalloc() may call pcreclaim(), so allocate before
+  // taking the lock.
+  mem = 0;
+  acquire(&pcache.lock);
+  c = pcfind(dev, inum, pg);
+  mapped = c && krefcnt(c->pa) > 1;
+  release(&pcache.lock);
+  if(mapped)
+    mem = kalloc();
+
+  acquire(&pcache.lock);
+  if((c = pcfind(dev, inum, pg)) != 0){
+    if(krefcnt(c->pa) > 1){
+      if(mem){
+        memmove(mem, c->pa, PGSIZE);
+        kfree(c->pa);
+        c->pa = mem;
+        mem = 0;
+      } else {
+        pcdrop(c);
+        c = 0;
+      }
+    }
+    if(c)
+      memmove(c->pa + off - pg, src, n);
+  }
+  // an unaligned page holding these bytes starts in their
+  // page or in the one before it.
+  for(i = 0; i < 2 && pg >= i*PGSIZE; i++){
+    for(c = pcache.bucket[PCHASH(dev, inum, pg - i*PGSIZE)]; c; c = next){
+      next = c->next;
+      if(c->dev == dev && c->inum == inum && c->off % PGSIZE &&
+         c->off < off + n && c->off + PGSIZE > off)
+        pcdrop(c);
+    }
+  }
+  release(&pcache.lock);
+  if(mem)
+    kfree(mem);
+}
+
+// Drop all of (dev, inum)'s pages, since its contents are
+// about to go. Processes that map them keep them.
+void
+pcinval(uint dev, uint inum)
+{
+  struct cpage *c;
+
+  acquire(&pcache.lock);
+  for(c = pcache.page; c < &pcache.page[NPCACHE]; c++){
+    if(c->pa && c->dev == dev && c->inum == inum)
+      pcdrop(c);
+  }
+  release(&pcache.lock);
+}
+
+// Free up to n cached pages that no process maps.
+// Returns how many were freed.
+int
+pcreclaim(int n)
+{
+  struct cpage *c;
+  int i, freed = 0;
+
+  acquire(&pcache.lock);
+  for(i = 0; i < NPCACHE && freed < n; i++){
+    c = pcache.hand;
+    if(++pcache.hand == &pcache.page[NPCACHE])
+      pcache.hand = pcache.page;
+    if(c->pa && krefcnt(c->pa) == 1){
+      pcdrop(c);
+      freed++;
+    }
+  }
+  release(&pcache.lock);
+  return freed;
+}
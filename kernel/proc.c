@@ -18,8 +18,31 @@ struct proc *initproc;
 int nextpid = 1;
 struct spinlock pid_lock;
 
+int schedpolicy = SCHED_RR;
+
+int nidle;  // CPUs waiting for work, with no clock tick
+
+// Ticks a process may run at MLFQ level prio
+// before it drops to the next level.
+#define QUANTUM(prio) (1 << (prio))
+
+// Sleeping processes, hashed by the channel they sleep
+// on, so that wakeup() looks only at the processes that
+// might be sleeping on its channel. Each queue is linked
+// through p->wqnext.
+#define NWAITQ 61
+#define WAITHASH(chan) (((uint64)(chan) >> 3) % NWAITQ)
+
+struct waitq {
+  struct spinlock lock;
+  struct proc *head;
+} waitq[NWAITQ];
+
 extern void forkret(void);
 static void wakeup1(struct proc *chan);
+static void unsleep(struct proc *p);
+static void runqput(struct proc *p);
+static void kick(struct cpu *c, int l);
 
 extern char trampoline[]; // trampoline.S
 
@@ -27,8 +50,16 @@ void
 procinit(void)
 {
   struct proc *p;
+  struct cpu *c;
+  struct waitq *q;
   
   initlock(&pid_lock, "nextpid");
+  for(q = waitq; q < &waitq[NWAITQ]; q++)
+    initlock(&q->lock, "waitq");
+  for(c = cpus; c < &cpus[NCPU]; c++)
+    initlock(&c->rqlock, "runq");
+  if(bootopt("sched=mlfq"))
+    schedpolicy = SCHED_MLFQ;
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
 
@@ -107,6 +138,10 @@ allocproc(void)
 
 found:
   p->pid = allocpid();
+  p->asidgen = 0;  // vmswitch() gives the new page table an ASID
+  p->prio = 0;
+  p->prioticks = 0;
+  p->boost = ticks / BOOSTTICKS;
 
   // Allocate a trapframe page.
   if((p->tf = (struct trapframe *)kalloc()) == 0){
@@ -149,7 +184,8 @@ freeproc(struct proc *p)
 }
 
 // Create a page table for a given process,
-// with no user pages, but with trampoline pages.
+// with no user pages, but with trampoline pages,
+// and the kernel's own mappings.
 pagetable_t
 proc_pagetable(struct proc *p)
 {
@@ -161,14 +197,21 @@ proc_pagetable(struct proc *p)
   // map the trampoline code (for system call return)
   // at the highest user virtual address.
   // only the supervisor uses it, on the way
-  // to/from user space, so not PTE_U.
+  // to/from user space, so not PTE_U. every page
+  // table has it, so it is global.
   mappages(pagetable, TRAMPOLINE, PGSIZE,
-           (uint64)trampoline, PTE_R | PTE_X);
+           (uint64)trampoline, PTE_R | PTE_X | PTE_G);
 
   // map the trapframe just below TRAMPOLINE, for trampoline.S.
   mappages(pagetable, TRAPFRAME, PGSIZE,
            (uint64)(p->tf), PTE_R | PTE_W);
 
+  // map the process's kernel stack where the kernel's page
+  // table has it, since the kernel runs on this page table
+  // while it works for p.
+  mappages(pagetable, p->kstack, PGSIZE,
+           kvmpa(p->kstack), PTE_R | PTE_W | PTE_G);
+
   return pagetable;
 }
 
@@ -177,10 +220,9 @@ proc_pagetable(struct proc *p)
 void
 proc_freepagetable(pagetable_t pagetable, uint64 sz)
 {
-  uvmunmap(pagetable, TRAMPOLINE, PGSIZE, 0);
-  uvmunmap(pagetable, TRAPFRAME, PGSIZE, 0);
-  if(sz > 0)
-    uvmfree(pagetable, sz);
+  // the trampoline, the trapframe, and the kernel stack.
+  uvmunmap(pagetable, USERTOP, MAXVA - USERTOP, 0);
+  uvmfree(pagetable, sz);
 }
 
 // a user program that calls exec("/init")
@@ -217,25 +259,33 @@ userinit(void)
   p->cwd = namei("/");
 
   p->state = RUNNABLE;
+  runqput(p);
 
   release(&p->lock);
 }
 
 // Grow or shrink user memory by n bytes.
+// Growing only reserves the addresses; the pages
+// are allocated when first touched (see uvmlazy()).
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
 {
-  uint sz;
+  uint64 sz;
   struct proc *p = myproc();
 
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
+    if(sz + n > HEAPTOP || sz + n > vmabase(p, sz))
       return -1;
-    }
+    sz += n;
   } else if(n < 0){
+    if(sz + n > sz)
+      return -1;
     sz = uvmdealloc(p->pagetable, sz, sz + n);
+    // the program's segments that lay above sz go too, so
+    // that memory that grows there again starts out zeroed.
+    vmaunmap(p, PGROUNDUP(sz), PGROUNDUP(p->sz) - PGROUNDUP(sz));
   }
   p->sz = sz;
   return 0;
@@ -250,18 +300,36 @@ fork(void)
   struct proc *np;
   struct proc *p = myproc();
 
-  // Allocate process.
+  // Parent and child share the pages of shared mappings,
+  // so those must all be present first.
+  if(vmaprefork(p) < 0)
+    return -1;
+
+  // Allocate process. If memory is exhausted, swap some
+  // out and try again.
+ retry:
   if((np = allocproc()) == 0){
+    if(swapreclaim())
+      goto retry;
     return -1;
   }
 
   // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+  if(uvmcopy(p->pagetable, np->pagetable, 0, p->sz, 0) < 0){
     freeproc(np);
     release(&np->lock);
+    if(swapreclaim())
+      goto retry;
     return -1;
   }
   np->sz = p->sz;
+  if(vmadup(np, p) < 0){
+    freeproc(np);
+    release(&np->lock);
+    if(swapreclaim())
+      goto retry;
+    return -1;
+  }
 
   np->parent = p;
 
@@ -281,7 +349,10 @@ fork(void)
 
   pid = np->pid;
 
+  // start the child on this CPU; an idle one may steal it.
+  np->cpu = p->cpu;
   np->state = RUNNABLE;
+  runqput(np);
 
   release(&np->lock);
 
@@ -334,6 +405,8 @@ exit(int status)
     }
   }
 
+  vmafree(p);
+
   begin_op(ROOTDEV);
   iput(p->cwd);
   end_op(ROOTDEV);
@@ -386,7 +459,7 @@ int
 wait(uint64 addr)
 {
   struct proc *np;
-  int havekids, pid;
+  int havekids, pid, xstate;
   struct proc *p = myproc();
 
   // hold p->lock for the whole time to avoid lost
@@ -406,17 +479,20 @@ wait(uint64 addr)
         acquire(&np->lock);
         havekids = 1;
         if(np->state == ZOMBIE){
-          // Found one.
+          // Found one. copy its status out without holding
+          // the locks, since the copy may fault and sleep.
+          // np stays a zombie meanwhile, as only its parent
+          // can reap it, and we're the parent.
           pid = np->pid;
-          if(addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate,
-                                  sizeof(np->xstate)) < 0) {
-            release(&np->lock);
-            release(&p->lock);
+          xstate = np->xstate;
+          release(&np->lock);
+          release(&p->lock);
+          if(addr != 0 && copyout(p->pagetable, addr, (char *)&xstate,
+                                  sizeof(xstate)) < 0)
             return -1;
-          }
+          acquire(&np->lock);
           freeproc(np);
           release(&np->lock);
-          release(&p->lock);
           return pid;
         }
         release(&np->lock);
@@ -434,13 +510,184 @@ wait(uint64 addr)
   }
 }
 
+// Under MLFQ, every BOOSTTICKS ticks all processes go back
+// to the top level, so that a CPU-bound process that has
+// sunk to the bottom cannot be starved, and one that has
+// turned interactive gets its priority back. Rather than
+// visit every process, each one catches up on boosts when
+// it is next looked at. Caller must hold p->lock.
+static void
+boost(struct proc *p)
+{
+  uint b = ticks / BOOSTTICKS;
+
+  if(p->boost != b){
+    p->boost = b;
+    p->prio = 0;
+    p->prioticks = 0;
+  }
+}
+
+// Put RUNNABLE p at the tail of the run queue of p->cpu,
+// the CPU it last ran on, whose TLB and caches may still
+// hold some of its state. Under MLFQ, p goes in the queue
+// of its level; under round robin, everything is in the
+// top one. Caller must hold p->lock, or, if p was asleep,
+// the lock of its wait queue.
+static void
+runqput(struct proc *p)
+{
+  struct cpu *c = &cpus[p->cpu];
+  int l = 0;
+
+  if(p->state != RUNNABLE)
+    panic("runqput");
+  if(schedpolicy == SCHED_MLFQ){
+    boost(p);
+    l = p->prio;
+  }
+  acquire(&c->rqlock);
+  p->rqnext = 0;
+  if(c->rqtail[l])
+    c->rqtail[l]->rqnext = p;
+  else
+    c->rqhead[l] = p;
+  c->rqtail[l] = p;
+  c->nrun++;
+  release(&c->rqlock);
+  kick(c, l);
+}
+
+// Work was just queued on c, at level l. An idle CPU has
+// no clock tick, and will only notice it if told: tell c if
+// it is idle, or, if c is busy running a process, an idle
+// CPU that could steal the work. idle() sets c->idle before
+// looking at the run queues, and this looks at it after
+// queueing, so one of them sees the other. If no CPU is
+// idle, and c's process is of a lower level, have c give
+// up the CPU now rather than at its next clock tick.
+static void
+kick(struct cpu *c, int l)
+{
+  struct cpu *v = &cpus[NCPU];
+  struct proc *q;
+
+  __sync_synchronize();
+  if(!c->idle){
+    if((q = c->proc) == 0)
+      return;
+    if(nidle > 0){
+      for(v = cpus; v < &cpus[NCPU]; v++){
+        if(v->idle)
+          break;
+      }
+    }
+    if(v < &cpus[NCPU])
+      c = v;
+    else if(schedpolicy == SCHED_MLFQ && l < q->prio)
+      c->resched = 1;  // only a hint, like q->prio
+    else
+      return;
+  }
+  push_off();
+  if(c != mycpu())
+    ipi(c - cpus);
+  else if(c->resched)
+    w_sip(r_sip() | 2);  // once this CPU can take it
+  pop_off();
+}
+
+// Take the oldest process of the highest level in c's run
+// queues, or return 0 if they are empty. After a priority
+// boost, the lower queues join the top one in one go; their
+// processes see the boost when they are chosen.
+static struct proc*
+runqget(struct cpu *c)
+{
+  struct proc *p = 0;
+  uint b = ticks / BOOSTTICKS;
+  int l;
+
+  acquire(&c->rqlock);
+  if(schedpolicy == SCHED_MLFQ && c->boost != b){
+    c->boost = b;
+    for(l = 1; l < NPRIO; l++){
+      if(c->rqhead[l] == 0)
+        continue;
+      if(c->rqtail[0])
+        c->rqtail[0]->rqnext = c->rqhead[l];
+      else
+        c->rqhead[0] = c->rqhead[l];
+      c->rqtail[0] = c->rqtail[l];
+      c->rqhead[l] = c->rqtail[l] = 0;
+    }
+  }
+  for(l = 0; l < NPRIO; l++){
+    if((p = c->rqhead[l]) != 0){
+      c->rqhead[l] = p->rqnext;
+      if(c->rqhead[l] == 0)
+        c->rqtail[l] = 0;
+      c->nrun--;
+      break;
+    }
+  }
+  release(&c->rqlock);
+  return p;
+}
+
+// c's run queue is empty: take a process from the
+// longest run queue of another CPU, or return 0 if
+// they are all empty. Looks at the queues' lengths
+// without their locks, so only locks a queue worth
+// stealing from.
+static struct proc*
+runqsteal(struct cpu *c)
+{
+  struct cpu *v, *victim = 0;
+
+  for(v = cpus; v < &cpus[NCPU]; v++){
+    if(v != c && v->nrun > 0 && (victim == 0 || v->nrun > victim->nrun))
+      victim = v;
+  }
+  if(victim == 0)
+    return 0;
+  return runqget(victim);
+}
+
+// Wait for an interrupt with this CPU's clock tick
+// stopped, unless there is work after all: only a timer
+// of this CPU's or an IPI from kick() will wake it.
+// Interrupts must be off.
+static void
+idle(void)
+{
+  struct cpu *v;
+
+  timeridle(1);
+  __sync_fetch_and_add(&nidle, 1);
+  __sync_synchronize();
+  for(v = cpus; v < &cpus[NCPU]; v++){
+    if(v->nrun > 0)
+      break;
+  }
+  if(v == &cpus[NCPU])
+    asm volatile("wfi");
+  __sync_fetch_and_sub(&nidle, 1);
+  timeridle(0);
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run.
+//  - choose a process to run: the oldest of the highest
+//    level in this CPU's run queues, or else one stolen
+//    from another CPU's.
 //  - swtch to start running that process.
 //  - eventually that process transfers control
 //    via swtch back to the scheduler.
+// A process is in exactly one run queue while it is
+// RUNNABLE, and in none otherwise, so choosing one
+// costs the same however many processes there are.
 void
 scheduler(void)
 {
@@ -452,38 +699,51 @@ scheduler(void)
     // Avoid deadlock by giving devices a chance to interrupt.
     intr_on();
 
-    // Run the for loop with interrupts off to avoid
+    // Look at the run queues with interrupts off to avoid
     // a race between an interrupt and WFI, which would
     // cause a lost wakeup.
     intr_off();
 
-    int found = 0;
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->scheduler, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-
-        found = 1;
-      }
+    if((p = runqget(c)) == 0 && (p = runqsteal(c)) == 0){
+      // nothing to run: zero a free page for kalloc_zeroed(),
+      // and only go idle if there is no need.
+      if(kzerofill() == 0)
+        idle();
+      continue;
+    }
 
-      // ensure that release() doesn't enable interrupts.
-      // again to avoid a race between interrupt and WFI.
-      c->intena = 0;
+    // p left its run queue, so nobody else can choose it.
+    // its lock may still be held by the CPU it last ran on,
+    // on the way out of sched().
+    acquire(&p->lock);
+    if(p->state != RUNNABLE)
+      panic("scheduler");
+    if(schedpolicy == SCHED_MLFQ)
+      boost(p);
+
+    // Switch to chosen process.  It is the process's job
+    // to release its lock and then reacquire it
+    // before jumping back to us.
+    p->state = RUNNING;
+    p->cpu = c - cpus;
+    c->proc = p;
+    c->resched = 0;
+    // run on p's page table, which maps the kernel too,
+    // so that copyin() and copyout() can reach p's memory
+    // with plain loads and stores.
+    vmswitch(p);
+    swtch(&c->scheduler, &p->context);
+    vmswitch(0);
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+
+    // ensure that release() doesn't enable interrupts.
+    // again to avoid a race between interrupt and WFI.
+    c->intena = 0;
 
-      release(&p->lock);
-    }
-    if(found == 0){
-      asm volatile("wfi");
-    }
+    release(&p->lock);
   }
 }
 
@@ -521,10 +781,56 @@ yield(void)
   struct proc *p = myproc();
   acquire(&p->lock);
   p->state = RUNNABLE;
+  runqput(p);
   sched();
   release(&p->lock);
 }
 
+// A timer interrupt arrived while the current process
+// was running. Under round robin, give up the CPU at every
+// tick. Under MLFQ, give it up when the process has used up
+// its level's quantum, and drop it to the next level, or
+// when a process of a higher level is waiting on this CPU.
+// A process that sleeps before its quantum is up keeps its
+// level, but not a fresh quantum, so it cannot stay on top
+// by sleeping just before its time runs out.
+void
+schedtick(void)
+{
+  struct proc *p = myproc();
+  struct cpu *c;
+  int l, give = 1;
+
+  if(schedpolicy == SCHED_MLFQ){
+    acquire(&p->lock);
+    boost(p);
+    if(++p->prioticks >= QUANTUM(p->prio)){
+      if(p->prio < NPRIO-1)
+        p->prio++;
+      p->prioticks = 0;
+    } else {
+      // only a hint: the queues may change meanwhile.
+      c = mycpu();
+      give = 0;
+      for(l = 0; l < p->prio; l++)
+        if(c->rqhead[l])
+          give = 1;
+    }
+    release(&p->lock);
+  }
+  if(give)
+    yield();
+}
+
+// Some other interrupt arrived while the current process
+// was running: give up the CPU if kick() asked for it.
+void
+schedkick(void)
+{
+  if(mycpu()->resched)
+    yield();
+}
+
 // A fork child's very first scheduling by scheduler()
 // will swtch to forkret.
 void
@@ -552,22 +858,31 @@ void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct waitq *q = &waitq[WAITHASH(chan)];
   
   // Must acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold p->lock, we can be
-  // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
-  // so it's okay to release lk.
   if(lk != &p->lock){  //DOC: sleeplock0
     acquire(&p->lock);  //DOC: sleeplock1
-    release(lk);
   }
 
-  // Go to sleep.
+  // Go to sleep. Once p is in chan's wait queue,
+  // we can be guaranteed that we won't miss any wakeup
+  // (wakeup locks the wait queue), so it's okay to
+  // release lk.
+  acquire(&q->lock);
   p->chan = chan;
   p->state = SLEEPING;
+  p->wqnext = q->head;
+  q->head = p;
+  release(&q->lock);
 
+  if(lk != &p->lock)
+    release(lk);
+
+  // a wakeup() may make p RUNNABLE from here on, but
+  // no CPU can run it until sched() has switched away
+  // and the scheduler has released p->lock.
   sched();
 
   // Tidy up.
@@ -581,19 +896,50 @@ sleep(void *chan, struct spinlock *lk)
 }
 
 // Wake up all processes sleeping on chan.
-// Must be called without any p->lock.
+// Looks only at chan's wait queue, and takes no p->lock,
+// so it may be called holding any of them.
 void
 wakeup(void *chan)
 {
-  struct proc *p;
+  struct waitq *q = &waitq[WAITHASH(chan)];
+  struct proc *p, **pp;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);
-    if(p->state == SLEEPING && p->chan == chan) {
+  acquire(&q->lock);
+  for(pp = &q->head; (p = *pp) != 0; ){
+    if(p->chan == chan){
+      *pp = p->wqnext;
       p->state = RUNNABLE;
+      runqput(p);
+    } else {
+      pp = &p->wqnext;
     }
-    release(&p->lock);
   }
+  release(&q->lock);
+}
+
+// Wake up p if it is still sleeping, whatever its channel:
+// take it out of its wait queue, and make it RUNNABLE.
+// Caller must hold p->lock, which keeps p->chan from
+// changing.
+static void
+unsleep(struct proc *p)
+{
+  struct waitq *q;
+  struct proc **pp;
+
+  if(p->state != SLEEPING)
+    return;
+  q = &waitq[WAITHASH(p->chan)];
+  acquire(&q->lock);
+  // a wakeup() may have got there first.
+  if(p->state == SLEEPING){
+    for(pp = &q->head; *pp != p; pp = &(*pp)->wqnext)
+      ;
+    *pp = p->wqnext;
+    p->state = RUNNABLE;
+    runqput(p);
+  }
+  release(&q->lock);
 }
 
 // Wake up p if it is sleeping in wait(); used by exit().
@@ -603,9 +949,8 @@ wakeup1(struct proc *p)
 {
   if(!holding(&p->lock))
     panic("wakeup1");
-  if(p->chan == p && p->state == SLEEPING) {
-    p->state = RUNNABLE;
-  }
+  if(p->chan == p)
+    unsleep(p);
 }
 
 // Kill the process with the given pid.
@@ -620,10 +965,34 @@ kill(int pid)
     acquire(&p->lock);
     if(p->pid == pid){
       p->killed = 1;
-      if(p->state == SLEEPING){
-        // Wake process from sleep().
-        p->state = RUNNABLE;
-      }
+      // Wake process from sleep().
+      unsleep(p);
+      release(&p->lock);
+      return 0;
+    }
+    release(&p->lock);
+  }
+  return -1;
+}
+
+// Move process pid to MLFQ level prio, with a fresh
+// quantum. If it is waiting to run, it moves the next time
+// it joins a run queue. Under round robin, the level is only
+// recorded. Returns 0, or -1 if there is no such process
+// or level.
+int
+setpriority(int pid, int prio)
+{
+  struct proc *p;
+
+  if(prio < 0 || prio >= NPRIO)
+    return -1;
+  for(p = proc; p < &proc[NPROC]; p++){
+    acquire(&p->lock);
+    if(p->pid == pid && p->state != UNUSED){
+      boost(p);
+      p->prio = prio;
+      p->prioticks = 0;
       release(&p->lock);
       return 0;
     }
@@ -632,6 +1001,28 @@ kill(int pid)
   return -1;
 }
 
+// Return the MLFQ level of process pid, or -1 if there
+// is no such process.
+int
+getpriority(int pid)
+{
+  struct proc *p;
+  int prio;
+
+  for(p = proc; p < &proc[NPROC]; p++){
+    acquire(&p->lock);
+    if(p->pid == pid && p->state != UNUSED){
+      if(schedpolicy == SCHED_MLFQ)
+        boost(p);
+      prio = p->prio;
+      release(&p->lock);
+      return prio;
+    }
+    release(&p->lock);
+  }
+  return -1;
+}
+
 // Copy to either a user address, or kernel address,
 // depending on usr_dst.
 // Returns 0 on success, -1 on error.
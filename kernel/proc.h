@@ -24,10 +24,27 @@ struct cpu {
   struct context scheduler;   // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  uint64 asidgen;             // ASID generation the TLB is clean for.
+
+  // RUNNABLE processes waiting for this cpu, one queue per
+  // priority level, oldest first, linked through p->rqnext.
+  struct spinlock rqlock;
+  struct proc *rqhead[NPRIO];
+  struct proc *rqtail[NPRIO];
+  int nrun;                   // Length of the run queues.
+  uint boost;                 // Last priority boost of the run queues.
+  int idle;                   // Waiting for work, with no clock tick?
+  int resched;                // Should the running process yield?
 };
 
 extern struct cpu cpus[NCPU];
 
+// Scheduling policies, chosen at boot (see procinit()).
+#define SCHED_RR   0  // round robin
+#define SCHED_MLFQ 1  // multi-level feedback queue
+
+extern int schedpolicy;
+
 // per-process data for the trap handling code in trampoline.S.
 // sits in a page by itself just under the trampoline page in the
 // user page table. not specially mapped in the kernel page table.
@@ -82,17 +99,52 @@ struct trapframe {
 
 enum procstate { UNUSED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// A range of user memory whose pages are read in from a
+// file the first time they are touched.
+struct vma {
+  uint64 addr;       // first address, page-aligned
+  uint64 len;        // length in bytes; 0 if unused
+  int perm;          // PTE_R, PTE_W and PTE_X for its pages
+  struct inode *ip;  // file holding the contents, or 0 for zeros
+  uint off;          // offset in ip of addr
+  uint filesz;       // bytes that come from ip; the rest are zero
+  int flags;         // VMA_SHARED
+};
+
+#define VMA_SHARED 0x1  // stores are written back to ip
+
 // Per-process state
 struct proc {
   struct spinlock lock;
 
-  // p->lock must be held when using these:
+  // p->lock must be held when using these. wakeup() makes
+  // a SLEEPING process RUNNABLE holding only its wait
+  // queue's lock, so changing a SLEEPING process's state
+  // needs that lock too.
   enum procstate state;        // Process state
   struct proc *parent;         // Parent process
   void *chan;                  // If non-zero, sleeping on chan
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int asid;                    // Address space ID of pagetable
+  uint64 asidgen;              // Generation of asid; 0 if none yet
+  int asidcpu;                 // Last CPU to run on pagetable
+  int cpu;                     // CPU whose run queue p joins
+  int prio;                    // MLFQ level; 0 is the highest
+  int prioticks;               // Ticks run at prio
+  uint boost;                  // Last priority boost applied to p
+
+  // the run queue's rqlock must be held when using this:
+  struct proc *rqnext;         // Next RUNNABLE process in run queue
+
+  // the wait queue's lock must be held when using this:
+  struct proc *wqnext;         // Next SLEEPING process in wait queue
+
+  // the timer wheel's lock must be held when using these:
+  uint64 tkey;                 // Wheel tick timersleep() ends at
+  int tslot;                   // Wheel slot holding p; -1 if none
+  struct proc *tnext;          // Next process in wheel slot
 
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
@@ -102,5 +154,6 @@ struct proc {
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct vma vma[NVMA];        // File-backed memory
   char name[16];               // Process name (debugging)
 };
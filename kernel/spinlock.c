@@ -7,8 +7,11 @@
 #include "riscv.h"
 #include "proc.h"
 #include "defs.h"
+#include "fs.h"
 
-#define NLOCK 1000
+// room for a lock per buffer, however many buffers
+// binit() makes of memory, and for all the others.
+#define NLOCK (2000 + (PHYSTOP - KERNBASE) / BCACHEFRAC / BSIZE)
 
 static int nlock;
 static struct spinlock *locks[NLOCK];
@@ -96,6 +99,19 @@ holding(struct spinlock *lk)
   return r;
 }
 
+// Is this cpu holding any spinlock, or inside a push_off()?
+// If so, the caller must not sleep.
+int
+holdingany(void)
+{
+  int r;
+
+  push_off();
+  r = mycpu()->noff > 1;
+  pop_off();
+  return r;
+}
+
 // push_off/pop_off are like intr_off()/intr_on() except that they are matched:
 // it takes two pop_off()s to undo two push_off()s.  Also, if interrupts
 // are initially off, then push_off, pop_off leaves them off.
@@ -0,0 +1,317 @@
+// Swap space.
+//
+// When memory runs out, swapreclaim() writes pages of process
+// memory that have not been used lately to the swap disk, and
+// frees them. A swapped-out page's PTE keeps its permissions
+// and the page's slot on the disk, but not PTE_V, so the next
+// access to the page faults, and vmfault() reads it back in.
+//
+// swapout() picks pages with a clock: it goes round the
+// processes' private memory, clearing each page's accessed bit,
+// and takes the pages whose bit is still clear the next time
+// round. It takes only pages that one PTE maps; pages shared
+// copy-on-write or with the page cache, megapages, and memory
+// of shared mappings, which munmap() writes back to the file,
+// stay put.
+//
+// swapout() changes the page tables of processes that are not
+// running, under their p->lock. Code that reads a PTE of the
+// current process and then changes it does so with interrupts
+// off, so that it cannot be preempted in between. Only the
+// PTE changes under p->lock: while a page is being written
+// out, it sits in swap.out, where a fault finds it.
+//
+// Each slot counts the PTEs that name it, since fork() copies
+// swapped-out PTEs.
+//
+// Interface:
+// * swapreclaim() frees memory after an allocation failed.
+// * swapread() reads a slot into a page.
+// * swapdup() and swapfree() add and drop a PTE naming a slot.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "fs.h"
+#include "buf.h"
+#include "defs.h"
+
+#define SWAPBATCH 16    // pages swapout() writes at a time
+#define SWAPSCAN 512    // pages it looks at per p->lock
+#define SLOTBLOCKS (PGSIZE / BSIZE)
+
+extern struct proc proc[NPROC];
+
+struct {
+  struct spinlock lock;
+  int nslot;            // slots on the swap disk; 0 if none
+  int next;             // where to look for a free slot
+  uchar ref[NSWAP];     // PTEs naming each slot; 0 if free
+  struct {
+    int slot;
+    char *pa;
+  } out[SWAPBATCH];     // pages being written out
+  int nout;
+
+  // swapout() only.
+  struct sleeplock outlock;  // one swapout() at a time
+  struct buf buf[SWAPBATCH][SLOTBLOCKS];
+  int hand;             // clock hand: process
+  uint64 handva;        // and address in it
+} swap;
+
+void
+swapinit(void)
+{
+  uint64 n;
+
+  initlock(&swap.lock, "swap");
+  initsleeplock(&swap.outlock, "swapout");
+  if(!virtio_disk_present(SWAPDEV))
+    return;
+  virtio_disk_init(SWAPDEV);
+  n = virtio_disk_size(SWAPDEV) / SLOTBLOCKS;
+  swap.nslot = n < NSWAP ? n : NSWAP;
+}
+
+// Start reading or writing the page at pa from or to slot,
+// using the SLOTBLOCKS buffers in bv.
+static void
+swapstart(struct buf *bv, char *pa, int slot, int write)
+{
+  struct buf *run[SLOTBLOCKS];
+  int i;
+
+  for(i = 0; i < SLOTBLOCKS; i++){
+    memset(&bv[i], 0, sizeof(bv[i]));
+    bv[i].dev = SWAPDEV;
+    bv[i].blockno = slot * SLOTBLOCKS + i;
+    bv[i].data = (uchar*)pa + i*BSIZE;
+    run[i] = &bv[i];
+  }
+  virtio_disk_submitv(SWAPDEV, run, SLOTBLOCKS, bv[0].blockno, write);
+}
+
+// Wait for swapstart() of bv to finish.
+static void
+swapwait(struct buf *bv)
+{
+  for(int i = 0; i < SLOTBLOCKS; i++)
+    virtio_disk_wait(SWAPDEV, &bv[i]);
+}
+
+// Return a free slot, with one reference, or -1 if swap is
+// full. A slot that is still being written out is not free,
+// even if its last PTE is gone. Caller holds swap.lock.
+static int
+slotalloc(void)
+{
+  int i, j, s;
+
+  for(i = 0; i < swap.nslot; i++){
+    s = swap.next;
+    if(++swap.next == swap.nslot)
+      swap.next = 0;
+    if(swap.ref[s] != 0)
+      continue;
+    for(j = 0; j < swap.nout; j++)
+      if(swap.out[j].slot == s)
+        break;
+    if(j < swap.nout)
+      continue;
+    swap.ref[s] = 1;
+    return s;
+  }
+  return -1;
+}
+
+// Another PTE names slot.
+void
+swapdup(uint slot)
+{
+  acquire(&swap.lock);
+  if(slot >= swap.nslot || swap.ref[slot] == 0 || swap.ref[slot] == 255)
+    panic("swapdup");
+  swap.ref[slot]++;
+  release(&swap.lock);
+}
+
+// A PTE naming slot is gone.
+void
+swapfree(uint slot)
+{
+  acquire(&swap.lock);
+  if(slot >= swap.nslot || swap.ref[slot] == 0)
+    panic("swapfree");
+  swap.ref[slot]--;
+  release(&swap.lock);
+}
+
+// Return a page holding the contents of slot, with a reference
+// for the caller, or 0 if memory is exhausted. The caller still
+// holds its reference to the slot. A page that is being written
+// out is taken back, unless other PTEs name its slot and so
+// want its contents as they are; then the caller gets a copy.
+char*
+swapread(uint slot)
+{
+  struct buf bv[SLOTBLOCKS];
+  char *pa, *mem;
+  int i;
+
+  acquire(&swap.lock);
+  for(i = 0; i < swap.nout; i++){
+    if(swap.out[i].slot == slot){
+      pa = swap.out[i].pa;
+      kref(pa);
+      if(swap.ref[slot] == 1){
+        release(&swap.lock);
+        return pa;
+      }
+      release(&swap.lock);
+      if((mem = kalloc()) != 0)
+        memmove(mem, pa, PGSIZE);
+      kfree(pa);
+      return mem;
+    }
+  }
+  release(&swap.lock);
+
+  if((mem = kalloc()) == 0)
+    return 0;
+  swapstart(bv, mem, slot, 0);
+  swapwait(bv);
+  return mem;
+}
+
+// Look at up to SWAPSCAN pages of p's private memory, from
+// the clock hand on: clear the accessed bits that are set, and
+// move pages whose bits are clear to swap.out, up to n of them.
+// Returns 1 if it stopped before the end of p's memory, 0 if
+// it reached the end, -1 if swap is full.
+static int
+swapscan(struct proc *p, int n)
+{
+  uint64 va, end;
+  pte_t *pte;
+  char *pa;
+  int i, slot;
+
+  acquire(&p->lock);
+  if(p->pagetable == 0 || p->state == UNUSED || p->state == ZOMBIE ||
+     (p->state == RUNNING && p != myproc())){
+    release(&p->lock);
+    return 0;
+  }
+
+  va = swap.handva;
+  for(i = 0; i < SWAPSCAN && swap.nout < n; ){
+    if((va = vmaprivate(p, va, &end)) >= MAXVA)
+      break;
+    for(; va < end && i < SWAPSCAN && swap.nout < n; va += PGSIZE, i++){
+      if((pte = walk(p->pagetable, va, 0)) == 0 || (*pte & PTE_MEGA)){
+        // no page-table page, or a megapage: skip to the
+        // next megapage.
+        va = MEGAROUNDUP(va + 1) - PGSIZE;
+        continue;
+      }
+      if((*pte & (PTE_V|PTE_U)) != (PTE_V|PTE_U))
+        continue;
+      if(*pte & PTE_A){
+        *pte &= ~PTE_A;
+        continue;
+      }
+      pa = (char*)PTE2PA(*pte);
+      if(krefcnt(pa) != 1)
+        continue;
+
+      acquire(&swap.lock);
+      if((slot = slotalloc()) < 0){
+        release(&swap.lock);
+        release(&p->lock);
+        return -1;
+      }
+      swap.out[swap.nout].slot = slot;
+      swap.out[swap.nout].pa = pa;
+      swap.nout++;
+      release(&swap.lock);
+
+      // the PTE's reference to pa is now swap.out's.
+      *pte = SLOT2PTE(slot) | (PTE_FLAGS(*pte) & ~(PTE_V|PTE_A|PTE_D));
+      if(p == myproc())
+        sfence_vma_va(va, p->asid);
+      else
+        p->asidcpu = -1;  // vmswitch() flushes p's ASID
+    }
+  }
+  swap.handva = va;
+  release(&p->lock);
+  return va < MAXVA;
+}
+
+// Write up to n pages that have not been used lately to swap,
+// and free them. Returns how many it freed.
+static int
+swapout(int n)
+{
+  int i, m, r, done;
+  char *pa[SWAPBATCH];
+
+  if(n > SWAPBATCH)
+    n = SWAPBATCH;
+  acquiresleep(&swap.outlock);
+
+  // twice round: the first time may only clear accessed bits.
+  for(done = 0; swap.nout < n && done <= 2*NPROC; ){
+    if((r = swapscan(&proc[swap.hand], n)) < 0)
+      break;
+    if(r == 0){
+      swap.handva = 0;
+      if(++swap.hand == NPROC)
+        swap.hand = 0;
+      done++;
+    }
+  }
+
+  m = swap.nout;
+  for(i = 0; i < m; i++)
+    swapstart(swap.buf[i], swap.out[i].pa, swap.out[i].slot, 1);
+  for(i = 0; i < m; i++)
+    swapwait(swap.buf[i]);
+
+  acquire(&swap.lock);
+  for(i = 0; i < m; i++)
+    pa[i] = swap.out[i].pa;
+  swap.nout = 0;
+  release(&swap.lock);
+  // a page that swapread() took back keeps its reference.
+  for(i = 0; i < m; i++)
+    kfree(pa[i]);
+
+  releasesleep(&swap.outlock);
+  return m;
+}
+
+// An allocation of process memory failed. If that is because
+// memory is exhausted, and the caller may sleep, write some
+// pages to swap to free memory. The pages may come from the
+// caller's own page table, so it must not be holding a PTE.
+// Returns 1 if the allocation is worth retrying, else 0.
+int
+swapreclaim(void)
+{
+  char *pa;
+
+  if(swap.nslot == 0 || holdingany())
+    return 0;
+  if((pa = kalloc()) != 0){
+    // the failure was not for lack of memory.
+    kfree(pa);
+    return 0;
+  }
+  return swapout(SWAPBATCH) > 0;
+}
@@ -15,6 +15,7 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "memlayout.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
@@ -322,6 +323,13 @@ sys_open(void)
     return -1;
   }
 
+  // an empty file has no blocks yet, so it can switch format.
+  if((omode & O_EXTENT) && ip->type == T_FILE && ip->size == 0 &&
+     ip->addrs[0] == 0 && !(ip->flags & I_EXTENT)){
+    ip->flags |= I_EXTENT;
+    iupdate(ip);
+  }
+
   if((f = filealloc()) == 0 || (fd = fdalloc(f)) < 0){
     if(f)
       fileclose(f);
@@ -372,9 +380,10 @@ sys_mknod(void)
   int major, minor;
 
   begin_op(ROOTDEV);
+  // the dinode keeps major and minor in a byte each.
   if((argstr(0, path, MAXPATH)) < 0 ||
-     argint(1, &major) < 0 ||
-     argint(2, &minor) < 0 ||
+     argint(1, &major) < 0 || major < 0 || major > 255 ||
+     argint(2, &minor) < 0 || minor < 0 || minor > 255 ||
      (ip = create(path, T_DEVICE, major, minor)) == 0){
     end_op(ROOTDEV);
     return -1;
@@ -483,3 +492,60 @@ sys_pipe(void)
   return 0;
 }
 
+// Map length bytes of fd at off, or zeros with MAP_ANONYMOUS,
+// into memory just below the process's other mappings.
+// The address hint is ignored. Pages are read in when
+// first touched.
+uint64
+sys_mmap(void)
+{
+  uint64 addr, len;
+  int length, prot, flags, off, perm;
+  struct file *f;
+  struct proc *p = myproc();
+
+  if(argaddr(0, &addr) < 0 || argint(1, &length) < 0 || argint(2, &prot) < 0 ||
+     argint(3, &flags) < 0 || argint(5, &off) < 0)
+    return -1;
+  if(length <= 0 || off < 0 || off % PGSIZE != 0 || (prot & PROT_READ) == 0)
+    return -1;
+  if(((flags & MAP_SHARED) != 0) == ((flags & MAP_PRIVATE) != 0))
+    return -1;
+  f = 0;
+  if((flags & MAP_ANONYMOUS) == 0){
+    if(argfd(4, 0, &f) < 0 || f->type != FD_INODE || !f->readable)
+      return -1;
+    if((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable)
+      return -1;
+  }
+
+  perm = PTE_R;
+  if(prot & PROT_WRITE)
+    perm |= PTE_W;
+  if(prot & PROT_EXEC)
+    perm |= PTE_X;
+  len = PGROUNDUP((uint64)length);
+  addr = vmabase(p, p->sz);
+  if(addr < MMAPBASE + len)
+    return -1;
+  addr -= len;
+  if(vmaadd(p, addr, length, perm, (f && (flags & MAP_SHARED)) ? VMA_SHARED : 0,
+            f ? f->ip : 0, off, f ? length : 0) < 0)
+    return -1;
+  return addr;
+}
+
+// Remove the mappings of length bytes at addr, writing
+// shared ones back to their files.
+uint64
+sys_munmap(void)
+{
+  uint64 addr;
+  int length;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &length) < 0)
+    return -1;
+  if(addr % PGSIZE != 0 || length <= 0)
+    return -1;
+  return vmaunmap(myproc(), addr, PGROUNDUP((uint64)length));
+}
@@ -52,25 +52,40 @@ sys_sbrk(void)
   return addr;
 }
 
+// Return the CLINT time that is cycles from now, or ~0 if
+// the clock cannot count that far, rather than a time that
+// has wrapped around into the past.
+static uint64
+deadline(uint64 cycles)
+{
+  uint64 now = timenow();
+
+  if(cycles > ~0L - now)
+    return ~0L;
+  return now + cycles;
+}
+
 uint64
 sys_sleep(void)
 {
   int n;
-  uint ticks0;
 
   if(argint(0, &n) < 0)
     return -1;
-  acquire(&tickslock);
-  ticks0 = ticks;
-  while(ticks - ticks0 < n){
-    if(myproc()->killed){
-      release(&tickslock);
-      return -1;
-    }
-    sleep(&ticks, &tickslock);
-  }
-  release(&tickslock);
-  return 0;
+  if(n <= 0)
+    return 0;
+  return timersleep(deadline((uint64)n * (CLINT_HZ / TICKHZ)));
+}
+
+uint64
+sys_nanosleep(void)
+{
+  uint64 ns, nspercycle = 1000000000L / CLINT_HZ;
+
+  if(argaddr(0, &ns) < 0)
+    return -1;
+  // whole CLINT cycles, rounded up.
+  return timersleep(deadline(ns / nspercycle + (ns % nspercycle != 0)));
 }
 
 uint64
@@ -83,6 +98,26 @@ sys_kill(void)
   return kill(pid);
 }
 
+uint64
+sys_setpriority(void)
+{
+  int pid, prio;
+
+  if(argint(0, &pid) < 0 || argint(1, &prio) < 0)
+    return -1;
+  return setpriority(pid, prio);
+}
+
+uint64
+sys_getpriority(void)
+{
+  int pid;
+
+  if(argint(0, &pid) < 0)
+    return -1;
+  return getpriority(pid);
+}
+
 // return how many clock tick interrupts have occurred
 // since start.
 uint64
@@ -0,0 +1,288 @@
+// Timers.
+//
+// Each CPU's timer interrupt does two jobs: the clock tick,
+// which counts ticks and preempts the running process, and
+// waking processes whose sleep is over. A sleeping process
+// waits in the timer wheel of the CPU it went to sleep on,
+// and each CPU asks the CLINT to interrupt it at its next
+// tick or its wheel's next event, whichever comes first. So
+// a short sleep ends close to its deadline rather than at a
+// tick, and a sleeper costs nothing until its time is up.
+//
+// A CPU with nothing to run stops its clock tick, and waits
+// only for its wheel's next event, or for another CPU to
+// send it an inter-processor interrupt (IPI) to say there
+// is work.
+//
+// Machine mode takes the CLINT's interrupts (timervec in
+// kernelvec.S): it disarms the timer, or acknowledges the
+// IPI, and passes the interrupt on as a software interrupt,
+// for timerintr() to handle. The kernel maps the CLINT at
+// CLINTVA to program it.
+//
+// A wheel counts time in wheel ticks of 1<<WHEELSHIFT CLINT
+// cycles. Level 0 of a wheel has a slot for each of the next
+// WHEELSLOTS wheel ticks. Each slot of level l holds the
+// timers due in a span of WHEELSLOTS^l wheel ticks, which
+// move down a level when their span begins. A timer further
+// off than the top level reaches waits in that level's last
+// slot, and goes back in when the slot's span begins.
+//
+// Interface:
+// * timerinithart() starts this CPU's clock tick.
+// * timeridle() stops and restarts it.
+// * ipi() interrupts another CPU.
+// * timenow() reads the CLINT's clock.
+// * timersleep() sleeps until a time on that clock.
+// * timerintr() handles a timer interrupt.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+#define WHEELSHIFT 12   // log2 of CLINT cycles per wheel tick
+#define WHEELBITS 6
+#define WHEELSLOTS (1 << WHEELBITS)
+#define NLEVEL 4
+#define TICKCYCLES (CLINT_HZ / TICKHZ)
+
+struct wheel {
+  struct spinlock lock;
+  uint64 tick;              // wheel ticks before this have expired
+  uint64 nexttick;          // CLINT time of the next clock tick
+  uint64 map[NLEVEL];       // slots that hold timers
+  struct proc *slot[NLEVEL][WHEELSLOTS];  // linked through p->tnext
+} wheels[NCPU];
+
+uint64
+timenow(void)
+{
+  return *(volatile uint64*)CLINTVA_MTIME;
+}
+
+// Put p, due at wheel tick p->tkey, which has not
+// expired yet, in w.
+static void
+wheeladd(struct wheel *w, struct proc *p)
+{
+  uint64 epoch = 0;
+  int l, s;
+
+  for(l = 0; l < NLEVEL; l++){
+    epoch = w->tick >> (l*WHEELBITS);
+    if((p->tkey >> (l*WHEELBITS)) - epoch < WHEELSLOTS)
+      break;
+  }
+  if(l == NLEVEL){
+    // too far off: wait in the top level's last slot.
+    l = NLEVEL-1;
+    s = (epoch + WHEELSLOTS - 1) % WHEELSLOTS;
+  } else {
+    s = (p->tkey >> (l*WHEELBITS)) % WHEELSLOTS;
+  }
+  p->tslot = l*WHEELSLOTS + s;
+  p->tnext = w->slot[l][s];
+  w->slot[l][s] = p;
+  w->map[l] |= 1L << s;
+}
+
+// Take p out of w.
+static void
+wheeldel(struct wheel *w, struct proc *p)
+{
+  int l = p->tslot / WHEELSLOTS;
+  int s = p->tslot % WHEELSLOTS;
+  struct proc **pp;
+
+  for(pp = &w->slot[l][s]; *pp != p; pp = &(*pp)->tnext)
+    ;
+  *pp = p->tnext;
+  if(w->slot[l][s] == 0)
+    w->map[l] &= ~(1L << s);
+  p->tslot = -1;
+}
+
+// Take all the timers out of slot s of level l of w,
+// and return them.
+static struct proc*
+wheeltake(struct wheel *w, int l, int s)
+{
+  struct proc *p = w->slot[l][s];
+
+  w->slot[l][s] = 0;
+  w->map[l] &= ~(1L << s);
+  return p;
+}
+
+// Return the first wheel tick, from w->tick on, at which
+// a slot of w expires or moves down a level, or ~0 if w
+// holds no timers.
+static uint64
+wheelnext(struct wheel *w)
+{
+  uint64 next = ~0L, epoch, m, t;
+  int l, cur, d;
+
+  for(l = 0; l < NLEVEL; l++){
+    if(w->map[l] == 0)
+      continue;
+    epoch = w->tick >> (l*WHEELBITS);
+    cur = epoch % WHEELSLOTS;
+    // turn the map so that bit 0 is the current slot.
+    m = (w->map[l] >> cur) | (cur ? w->map[l] << (WHEELSLOTS - cur) : 0);
+    for(d = 0; (m & 1) == 0; d++)
+      m >>= 1;
+    t = (epoch + d) << (l*WHEELBITS);
+    if(t < w->tick)
+      t = w->tick;  // the span began at w->tick
+    if(t < next)
+      next = t;
+  }
+  return next;
+}
+
+// Bring w up to CLINT time now: move timers down a level
+// when their span begins, and wake the processes whose
+// timers expire.
+static void
+wheeladvance(struct wheel *w, uint64 now)
+{
+  uint64 t, end = now >> WHEELSHIFT;
+  struct proc *p, *next;
+  int l;
+
+  while((t = wheelnext(w)) <= end){
+    w->tick = t;
+    for(l = NLEVEL-1; l > 0; l--){
+      if(t % (1L << (l*WHEELBITS)) != 0)
+        continue;
+      for(p = wheeltake(w, l, (t >> (l*WHEELBITS)) % WHEELSLOTS); p; p = next){
+        next = p->tnext;
+        wheeladd(w, p);
+      }
+    }
+    for(p = wheeltake(w, 0, t % WHEELSLOTS); p; p = next){
+      next = p->tnext;
+      p->tslot = -1;
+      wakeup(&p->tslot);
+    }
+    w->tick = t + 1;
+  }
+  if(w->tick <= end)
+    w->tick = end + 1;
+}
+
+// Ask the CLINT to interrupt this CPU, which w belongs to,
+// at its next clock tick, unless it is idle, or w's next
+// event.
+static void
+wheelarm(struct wheel *w)
+{
+  uint64 t, when = mycpu()->idle ? ~0L : w->nexttick;
+
+  if((t = wheelnext(w)) != ~0L && (t << WHEELSHIFT) < when)
+    when = t << WHEELSHIFT;
+  *(uint64*)CLINTVA_MTIMECMP(cpuid()) = when;
+}
+
+void
+timerinithart(void)
+{
+  struct wheel *w = &wheels[cpuid()];
+
+  initlock(&w->lock, "wheel");
+  acquire(&w->lock);
+  w->tick = timenow() >> WHEELSHIFT;
+  w->nexttick = timenow() + TICKCYCLES;
+  wheelarm(w);
+  release(&w->lock);
+}
+
+// This CPU is going idle, or back to work: stop its clock
+// tick, or restart it and catch ticks up with the time it
+// was stopped. Interrupts must be off.
+void
+timeridle(int idle)
+{
+  struct wheel *w = &wheels[cpuid()];
+
+  acquire(&w->lock);
+  mycpu()->idle = idle;
+  if(!idle)
+    w->nexttick = timenow() + TICKCYCLES;
+  wheelarm(w);
+  release(&w->lock);
+  if(!idle)
+    clockintr();
+}
+
+// Interrupt CPU id, to have it look at the run queues.
+void
+ipi(int id)
+{
+  *(volatile uint32*)CLINTVA_MSIP(id) = 1;
+}
+
+// Sleep until the CLINT's clock reaches when.
+// Returns 0, or -1 if the process was killed.
+int
+timersleep(uint64 when)
+{
+  struct proc *p = myproc();
+  struct wheel *w;
+  int r = 0;
+
+  if(when <= timenow())
+    return 0;
+
+  push_off();
+  w = &wheels[cpuid()];
+  acquire(&w->lock);
+  pop_off();
+
+  // round up to a wheel tick, so as not to wake early,
+  // without overflowing if when is near ~0.
+  p->tkey = (when >> WHEELSHIFT) + ((when & ((1L << WHEELSHIFT) - 1)) != 0);
+  wheeladd(w, p);
+  wheelarm(w);
+  while(p->tslot >= 0){
+    if(p->killed){
+      wheeldel(w, p);
+      r = -1;
+      break;
+    }
+    sleep(&p->tslot, &w->lock);
+  }
+  release(&w->lock);
+  return r;
+}
+
+// A timer interrupt, or an IPI: count a clock tick if one
+// is due, wake the sleepers whose time is up, and ask for
+// the next interrupt. Returns 1 if it was a clock tick.
+int
+timerintr(void)
+{
+  struct wheel *w = &wheels[cpuid()];
+  uint64 now = timenow();
+  int tick = 0;
+
+  acquire(&w->lock);
+  if(!mycpu()->idle && now >= w->nexttick){
+    tick = 1;
+    w->nexttick += TICKCYCLES;
+    if(w->nexttick <= now)
+      w->nexttick = now + TICKCYCLES;  // missed some
+  }
+  wheeladvance(w, now);
+  wheelarm(w);
+  release(&w->lock);
+
+  if(tick)
+    clockintr();
+  return tick;
+}
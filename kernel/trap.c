@@ -11,11 +11,30 @@ uint ticks;
 
 extern char trampoline[], uservec[], userret[];
 
+// in copyuser.S.
+extern char ucopy[], ucopyend[], ucopyfault[];
+
 // in kernelvec.S, calls kerneltrap().
 void kernelvec();
 
 extern int devintr();
 
+// if scause is a page fault, return the kind of access
+// that faulted, as a PTE permission bit; else 0.
+static int
+faultaccess(uint64 scause)
+{
+  switch(scause){
+  case 12:
+    return PTE_X;
+  case 13:
+    return PTE_R;
+  case 15:
+    return PTE_W;
+  }
+  return 0;
+}
+
 void
 trapinit(void)
 {
@@ -67,6 +86,9 @@ usertrap(void)
     syscall();
   } else if((which_dev = devintr()) != 0){
     // ok
+  } else if(faultaccess(r_scause()) != 0 &&
+            vmfault(p, r_stval(), faultaccess(r_scause())) == 0){
+    // page fault, resolved
   } else {
     printf("usertrap(): unexpected scause %p pid=%d\n", r_scause(), p->pid);
     printf("            sepc=%p stval=%p\n", r_sepc(), r_stval());
@@ -76,9 +98,12 @@ usertrap(void)
   if(p->killed)
     exit(-1);
 
-  // give up the CPU if this is a timer interrupt.
+  // give up the CPU if this is a timer interrupt,
+  // or another CPU asked for it.
   if(which_dev == 2)
-    yield();
+    schedtick();
+  else if(which_dev != 0)
+    schedkick();
 
   usertrapret();
 }
@@ -118,7 +143,7 @@ usertrapret(void)
   w_sepc(p->tf->epc);
 
   // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
+  uint64 satp = MAKE_SATP(p->pagetable, p->asid);
 
   // jump to trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
@@ -142,15 +167,35 @@ kerneltrap()
   if(intr_get() != 0)
     panic("kerneltrap: interrupts enabled");
 
-  if((which_dev = devintr()) == 0){
+  if((scause == 13 || scause == 15) &&
+     sepc >= (uint64)ucopy && sepc < (uint64)ucopyend){
+    // copyin() or copyout() touched a user page that is not
+    // there yet, or is copy-on-write. resolve the fault like
+    // usertrap() would, maybe sleeping to read the page in,
+    // or make the copy fail. sstatus.SUM is still set for
+    // the copy; clear it, so that it does not stay set on this
+    // CPU if vmfault() sleeps. w_sstatus() below restores it.
+    uint64 va = r_stval();
+    w_sstatus(sstatus & ~SSTATUS_SUM);
+    if(mycpu()->noff == 0)
+      intr_on();
+    if(vmfault(myproc(), va, faultaccess(scause)) != 0)
+      sepc = (uint64)ucopyfault;
+    intr_off();
+  } else if((which_dev = devintr()) == 0){
     printf("scause %p\n", scause);
     printf("sepc=%p stval=%p\n", r_sepc(), r_stval());
     panic("kerneltrap");
   }
 
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING)
-    yield();
+  // give up the CPU if this is a timer interrupt,
+  // or another CPU asked for it.
+  if(which_dev != 0 && myproc() != 0 && myproc()->state == RUNNING){
+    if(which_dev == 2)
+      schedtick();
+    else
+      schedkick();
+  }
 
   // the yield() may have caused some traps to occur,
   // so restore trap registers for use by kernelvec.S's sepc instruction.
@@ -158,12 +203,17 @@ kerneltrap()
   w_sstatus(sstatus);
 }
 
+// a clock tick on some CPU. idle CPUs have no tick, and
+// any CPU may be the only one with one, so ticks follows
+// the CLINT's clock rather than counting the calls.
 void
 clockintr()
 {
+  uint t = timenow() / (CLINT_HZ / TICKHZ);
+
   acquire(&tickslock);
-  ticks++;
-  wakeup(&ticks);
+  if(t > ticks)
+    ticks = t;
   release(&tickslock);
 }
 
@@ -198,18 +248,17 @@ devintr()
 
     return 1;
   } else if(scause == 0x8000000000000001L){
-    // software interrupt from a machine-mode timer interrupt,
-    // forwarded by timervec in kernelvec.S.
+    // software interrupt from a machine-mode timer interrupt
+    // or IPI, forwarded by timervec in kernelvec.S, or raised
+    // by kick() on its own CPU.
 
-    if(cpuid() == 0){
-      clockintr();
-    }
-    
     // acknowledge the software interrupt by clearing
-    // the SSIP bit in sip.
+    // the SSIP bit in sip, before timerintr() asks for
+    // the next one, which may be due at once.
     w_sip(r_sip() & ~2);
 
-    return 2;
+    // a clock tick, or only sleepers to wake?
+    return timerintr() ? 2 : 1;
   } else {
     return 0;
   }
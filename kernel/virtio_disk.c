@@ -39,10 +39,21 @@ struct disk {
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
+    struct buf *b[MAXSEG]; // one per data descriptor
+    int nb;
     char status;
   } info[NUM];
 
+  // disk command headers.
+  // one-for-one with descriptors, for convenience.
+  struct virtio_blk_outhdr ops[NUM];
+
+  // indirect descriptor tables, one per head descriptor,
+  // used if the device offers VIRTIO_RING_F_INDIRECT_DESC.
+  // then every request takes only one ring descriptor.
+  struct VRingDesc indirect[NUM][MAXSEG+2];
+  int use_indirect;
+
   // initialized?
   int init;
 
@@ -64,10 +75,7 @@ virtio_disk_init(int n)
   
   initlock(&disk[n].vdisk_lock, "virtio_disk");
 
-  if(*R(n, VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
-     *R(n, VIRTIO_MMIO_VERSION) != 1 ||
-     *R(n, VIRTIO_MMIO_DEVICE_ID) != 2 ||
-     *R(n, VIRTIO_MMIO_VENDOR_ID) != 0x554d4551){
+  if(!virtio_disk_present(n)){
     panic("could not find virtio disk");
   }
 
@@ -85,8 +93,8 @@ virtio_disk_init(int n)
   features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
   features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
-  features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
   *R(n, VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  disk[n].use_indirect = (features & (1 << VIRTIO_RING_F_INDIRECT_DESC)) != 0;
 
   // tell device that feature negotiation is complete.
   status |= VIRTIO_CONFIG_S_FEATURES_OK;
@@ -124,6 +132,26 @@ virtio_disk_init(int n)
   // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
 }
 
+// is there a virtio disk at slot n?
+// qemu's empty slots have device ID 0.
+int
+virtio_disk_present(int n)
+{
+  return *R(n, VIRTIO_MMIO_MAGIC_VALUE) == 0x74726976 &&
+    *R(n, VIRTIO_MMIO_VERSION) == 1 &&
+    *R(n, VIRTIO_MMIO_DEVICE_ID) == 2 &&
+    *R(n, VIRTIO_MMIO_VENDOR_ID) == 0x554d4551;
+}
+
+// size of disk n, in blocks.
+uint64
+virtio_disk_size(int n)
+{
+  uint64 sectors = *R(n, VIRTIO_MMIO_CONFIG) |
+    ((uint64)*R(n, VIRTIO_MMIO_CONFIG + 4) << 32);
+  return sectors / (BSIZE / 512);
+}
+
 // find a free descriptor, mark it non-free, return its index.
 static int
 alloc_desc(int n)
@@ -163,10 +191,11 @@ free_chain(int n, int i)
   }
 }
 
+// allocate nd descriptors, which need not be contiguous.
 static int
-alloc3_desc(int n, int *idx)
+alloc_descs(int n, int *idx, int nd)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < nd; i++){
     idx[i] = alloc_desc(n);
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -177,106 +206,179 @@ alloc3_desc(int n, int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(int n, struct buf *b, int write)
+// the most blocks one request can carry.
+static int
+maxseg(int n)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
-
-  acquire(&disk[n].vdisk_lock);
-
-  // the spec says that legacy block operations use three
-  // descriptors: one for type/reserved/sector, one for
-  // the data, one for a 1-byte status result.
+  return disk[n].use_indirect ? MAXSEG : NUM - 2;
+}
 
-  // allocate the three descriptors.
-  int idx[3];
+// queue one request moving bv[0..nb-1] to or from consecutive
+// blocks starting at blockno. nb must be at most maxseg(n).
+// caller holds vdisk_lock.
+static void
+submit1(int n, struct buf **bv, int nb, uint blockno, int write)
+{
+  int idx[NUM], chain[MAXSEG+2];
+  struct VRingDesc *d;
+  int i, head;
+
+  // the spec says that legacy block operations use a
+  // descriptor for type/reserved/sector, one for each
+  // piece of data, and one for a 1-byte status result.
+  // with indirect descriptors they all live in a table
+  // that a single ring descriptor points to.
   while(1){
-    if(alloc3_desc(n, idx) == 0) {
+    if(alloc_descs(n, idx, disk[n].use_indirect ? 1 : nb + 2) == 0) {
       break;
     }
     sleep(&disk[n].free[0], &disk[n].vdisk_lock);
   }
-  
-  // format the three descriptors.
+  head = idx[0];
+
+  if(disk[n].use_indirect){
+    d = disk[n].indirect[head];
+    for(i = 0; i < nb + 2; i++)
+      chain[i] = i;
+    disk[n].desc[head].addr = (uint64) d;
+    disk[n].desc[head].len = (nb + 2) * sizeof(struct VRingDesc);
+    disk[n].desc[head].flags = VRING_DESC_F_INDIRECT;
+    disk[n].desc[head].next = 0;
+  } else {
+    d = disk[n].desc;
+    for(i = 0; i < nb + 2; i++)
+      chain[i] = idx[i];
+  }
+
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_outhdr {
-    uint32 type;
-    uint32 reserved;
-    uint64 sector;
-  } buf0;
+  struct virtio_blk_outhdr *buf0 = &disk[n].ops[head];
 
   if(write)
-    buf0.type = VIRTIO_BLK_T_OUT; // write the disk
+    buf0->type = VIRTIO_BLK_T_OUT; // write the disk
   else
-    buf0.type = VIRTIO_BLK_T_IN; // read the disk
-  buf0.reserved = 0;
-  buf0.sector = sector;
-
-  // buf0 is on a kernel stack, which is not direct mapped,
-  // thus the call to kvmpa().
-  disk[n].desc[idx[0]].addr = (uint64) kvmpa((uint64) &buf0);
-  disk[n].desc[idx[0]].len = sizeof(buf0);
-  disk[n].desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk[n].desc[idx[0]].next = idx[1];
-
-  disk[n].desc[idx[1]].addr = (uint64) b->data;
-  disk[n].desc[idx[1]].len = BSIZE;
-  if(write)
-    disk[n].desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk[n].desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk[n].desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk[n].desc[idx[1]].next = idx[2];
+    buf0->type = VIRTIO_BLK_T_IN; // read the disk
+  buf0->reserved = 0;
+  buf0->sector = (uint64)blockno * (BSIZE / 512);
+
+  // disk[] is in the kernel's direct-mapped data, so the
+  // header's virtual address is also its physical address.
+  d[chain[0]].addr = (uint64) buf0;
+  d[chain[0]].len = sizeof(*buf0);
+  d[chain[0]].flags = VRING_DESC_F_NEXT;
+  d[chain[0]].next = chain[1];
+
+  for(i = 0; i < nb; i++){
+    d[chain[i+1]].addr = (uint64) bv[i]->data;
+    d[chain[i+1]].len = BSIZE;
+    if(write)
+      d[chain[i+1]].flags = 0; // device reads b->data
+    else
+      d[chain[i+1]].flags = VRING_DESC_F_WRITE; // device writes b->data
+    d[chain[i+1]].flags |= VRING_DESC_F_NEXT;
+    d[chain[i+1]].next = chain[i+2];
 
-  disk[n].info[idx[0]].status = 0;
-  disk[n].desc[idx[2]].addr = (uint64) &disk[n].info[idx[0]].status;
-  disk[n].desc[idx[2]].len = 1;
-  disk[n].desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk[n].desc[idx[2]].next = 0;
+    // record struct buf for virtio_disk_intr().
+    bv[i]->disk = 1;
+    disk[n].info[head].b[i] = bv[i];
+  }
+  disk[n].info[head].nb = nb;
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk[n].info[idx[0]].b = b;
+  disk[n].info[head].status = 0;
+  d[chain[nb+1]].addr = (uint64) &disk[n].info[head].status;
+  d[chain[nb+1]].len = 1;
+  d[chain[nb+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  d[chain[nb+1]].next = 0;
 
   // avail[0] is flags
   // avail[1] tells the device how far to look in avail[2...].
   // avail[2...] are desc[] indices the device should process.
   // we only tell device the first index in our chain of descriptors.
-  disk[n].avail[2 + (disk[n].avail[1] % NUM)] = idx[0];
+  disk[n].avail[2 + (disk[n].avail[1] % NUM)] = head;
   __sync_synchronize();
   disk[n].avail[1] = disk[n].avail[1] + 1;
 
   *R(n, VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+}
 
-  // Wait for virtio_disk_intr() to say request has finished.
-  while(b->disk == 1) {
-    sleep(b, &disk[n].vdisk_lock);
+// Queue requests to read or write the nb buffers in bv from
+// or to consecutive blocks starting at blockno, as few
+// requests as the device allows, and return without waiting
+// for them to finish. The blocks are normally the buffers'
+// own, but log.c writes cached blocks straight into the log.
+// The caller must hold each buffer's lock until
+// virtio_disk_wait() returns for it, and may have many
+// requests outstanding at once.
+void
+virtio_disk_submitv(int n, struct buf **bv, int nb, uint blockno, int write)
+{
+  int m;
+
+  acquire(&disk[n].vdisk_lock);
+  while(nb > 0){
+    m = nb < maxseg(n) ? nb : maxseg(n);
+    submit1(n, bv, m, blockno, write);
+    bv += m;
+    nb -= m;
+    blockno += m;
   }
+  release(&disk[n].vdisk_lock);
+}
 
-  disk[n].info[idx[0]].b = 0;
-  free_chain(n, idx[0]);
+// Queue a request for a single buffer b and block blockno.
+void
+virtio_disk_submit(int n, struct buf *b, uint blockno, int write)
+{
+  virtio_disk_submitv(n, &b, 1, blockno, write);
+}
 
+// Wait for virtio_disk_intr() to say that the request
+// for b has finished.
+void
+virtio_disk_wait(int n, struct buf *b)
+{
+  acquire(&disk[n].vdisk_lock);
+  while(b->disk == 1) {
+    sleep(b, &disk[n].vdisk_lock);
+  }
   release(&disk[n].vdisk_lock);
 }
 
+void
+virtio_disk_rw(int n, struct buf *b, int write)
+{
+  virtio_disk_submit(n, b, b->blockno, write);
+  virtio_disk_wait(n, b);
+}
+
 void
 virtio_disk_intr(int n)
 {
   acquire(&disk[n].vdisk_lock);
 
+  // tell the device we've seen this interrupt.
+  *R(n, VIRTIO_MMIO_INTERRUPT_ACK) = *R(n, VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
+
   while((disk[n].used_idx % NUM) != (disk[n].used->id % NUM)){
     int id = disk[n].used->elems[disk[n].used_idx].id;
 
     if(disk[n].info[id].status != 0)
       panic("virtio_disk_intr status");
     
-    disk[n].info[id].b->disk = 0;   // disk is done with buf
-    wakeup(disk[n].info[id].b);
+    for(int i = 0; i < disk[n].info[id].nb; i++){
+      disk[n].info[id].b[i]->disk = 0;   // disk is done with buf
+      wakeup(disk[n].info[id].b[i]);
+      disk[n].info[id].b[i] = 0;
+    }
+    disk[n].info[id].nb = 0;
+
+    // the submitter may not be waiting yet, so free
+    // the chain here rather than in virtio_disk_wait().
+    free_chain(n, id);
 
     disk[n].used_idx = (disk[n].used_idx + 1) % NUM;
   }
 
   release(&disk[n].vdisk_lock);
 }
-
@@ -3,6 +3,8 @@
 #include "memlayout.h"
 #include "elf.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
 #include "defs.h"
 #include "fs.h"
 
@@ -17,6 +19,24 @@ extern char trampoline[]; // trampoline.S
 
 void print(pagetable_t);
 
+// uvmunmap() of more pages than this flushes the whole
+// address space from the TLB, rather than page by page.
+#define TLBFLUSHMAX 64
+
+// Address space IDs. Each process's page table gets an ASID,
+// which tags its TLB entries, so that switching page tables
+// need not flush the TLB. The kernel's page table has ASID 0,
+// and its mappings, which every page table shares, are global.
+// ASIDs are handed out in generations: when a generation's run
+// out, a new one starts, and each CPU flushes its whole TLB
+// before it next switches to a page table of the new one.
+struct {
+  struct spinlock lock;
+  uint64 gen;   // generation being handed out
+  int next;     // next free ASID in it
+  int max;      // largest ASID the hardware has; 0 if none
+} asid;
+
 /*
  * create a direct-map page table for the kernel and
  * turn on paging. called early, in supervisor mode.
@@ -25,6 +45,10 @@ void print(pagetable_t);
 void
 kvminit()
 {
+  initlock(&asid.lock, "asid");
+  asid.gen = 1;
+  asid.next = 1;
+
   kernel_pagetable = (pagetable_t) kalloc();
   memset(kernel_pagetable, 0, PGSIZE);
 
@@ -37,17 +61,19 @@ kvminit()
   // virtio mmio disk interface 1
   kvmmap(VIRTION(1), VIRTION(1), PGSIZE, PTE_R | PTE_W);
 
-  // CLINT
-  kvmmap(CLINT, CLINT, 0x10000, PTE_R | PTE_W);
+  // CLINT, for timer.c to program the timer. not where it
+  // is, since a process's heap may cover that.
+  kvmmap(CLINTVA, CLINT, 0x10000, PTE_R | PTE_W);
 
   // PLIC
-  kvmmap(PLIC, PLIC, 0x400000, PTE_R | PTE_W);
+  kvmmap(PLIC, PLIC, 0x400000, PTE_R | PTE_W | PTE_MEGA);
 
   // map kernel text executable and read-only.
   kvmmap(KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
 
-  // map kernel data and the physical RAM we'll make use of.
-  kvmmap((uint64)etext, (uint64)etext, PHYSTOP-(uint64)etext, PTE_R | PTE_W);
+  // map kernel data and the physical RAM we'll make use of,
+  // in megapages from the first megapage boundary on.
+  kvmmap((uint64)etext, (uint64)etext, PHYSTOP-(uint64)etext, PTE_R | PTE_W | PTE_MEGA);
 
   // map the trampoline for trap entry/exit to
   // the highest virtual address in the kernel.
@@ -59,48 +85,167 @@ kvminit()
 void
 kvminithart()
 {
-  w_satp(MAKE_SATP(kernel_pagetable));
+  // satp keeps only the ASID bits the hardware has.
+  w_satp(MAKE_SATP(kernel_pagetable, SATP_ASIDMASK));
+  asid.max = SATP2ASID(r_satp());
+  w_satp(MAKE_SATP(kernel_pagetable, 0));
   sfence_vma();
+  mycpu()->asidgen = asid.gen;
 }
 
-// Return the address of the PTE in page table pagetable
-// that corresponds to virtual address va.  If alloc!=0,
-// create any required page-table pages.
-//
-// The risc-v Sv39 scheme has three levels of page-table
-// pages. A page-table page contains 512 64-bit PTEs.
-// A 64-bit virtual address is split into five fields:
-//   39..63 -- must be zero.
-//   30..38 -- 9 bits of level-2 index.
-//   21..39 -- 9 bits of level-1 index.
-//   12..20 -- 9 bits of level-0 index.
-//    0..12 -- 12 bits of byte offset within the page.
+// Switch this CPU to p's page table, or to the kernel's if p
+// is 0, and make sure that the TLB holds no stale entries for
+// it: give p's page table an ASID if it has none of the current
+// generation, and flush the ASID if p last ran on another CPU,
+// which may have changed p's mappings. Otherwise the TLB is
+// left alone. Caller must hold p->lock.
+void
+vmswitch(struct proc *p)
+{
+  struct cpu *c = mycpu();
+  int id = cpuid();
+  uint64 gen;
+
+  if(p == 0){
+    w_satp(MAKE_SATP(kernel_pagetable, 0));
+    return;
+  }
+
+  acquire(&asid.lock);
+  if(p->asidgen != asid.gen){
+    if(asid.next > asid.max){
+      asid.gen++;
+      asid.next = 1;
+    }
+    // without ASIDs, every page table uses 0, and each
+    // new one starts a generation.
+    p->asid = asid.max ? asid.next : 0;
+    asid.next++;
+    p->asidgen = asid.gen;
+    p->asidcpu = id;
+  }
+  gen = asid.gen;
+  release(&asid.lock);
+
+  w_satp(MAKE_SATP(p->pagetable, p->asid));
+  if(c->asidgen != gen){
+    sfence_vma();
+    c->asidgen = gen;
+  } else if(p->asidcpu != id){
+    sfence_vma_asid(p->asid);
+  }
+  p->asidcpu = id;
+}
+
+// Flush this CPU's TLB entry for va in pagetable, if pagetable
+// is the one it is using. Other user page tables are not in
+// use anywhere: a process runs on one CPU at a time, and
+// vmswitch() flushes its ASID when it moves.
+static void
+tlbflush(pagetable_t pagetable, uint64 va)
+{
+  uint64 satp = r_satp();
+
+  if(SATP2PA(satp) == (uint64)pagetable)
+    sfence_vma_va(va, SATP2ASID(satp));
+}
+
+// Flush all of this CPU's TLB entries for pagetable, if it
+// is the one in use.
+static void
+tlbflushall(pagetable_t pagetable)
+{
+  uint64 satp = r_satp();
+
+  if(SATP2PA(satp) == (uint64)pagetable)
+    sfence_vma_asid(SATP2ASID(satp));
+}
+
+// Return the address of the PTE at level leaf in page table
+// pagetable that corresponds to virtual address va, or of
+// the megapage PTE that maps va, if a level-1 PTE is one.
+// If alloc!=0, create any required page-table pages.
 static pte_t *
-walk(pagetable_t pagetable, uint64 va, int alloc)
+walkto(pagetable_t pagetable, uint64 va, int alloc, int leaf)
 {
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
+  for(int level = 2; level > leaf; level--) {
     pte_t *pte = &pagetable[PX(level, va)];
     if(*pte & PTE_V) {
+      if(*pte & PTE_MEGA)
+        return pte;
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
-  return &pagetable[PX(0, va)];
+  return &pagetable[PX(leaf, va)];
+}
+
+// Return the address of the leaf PTE in page table pagetable
+// that corresponds to virtual address va: a level-0 PTE, or
+// a level-1 PTE with PTE_MEGA set if a megapage maps va.
+// If alloc!=0, create any required page-table pages.
+//
+// The risc-v Sv39 scheme has three levels of page-table
+// pages. A page-table page contains 512 64-bit PTEs.
+// A 64-bit virtual address is split into five fields:
+//   39..63 -- must be zero.
+//   30..38 -- 9 bits of level-2 index.
+//   21..39 -- 9 bits of level-1 index.
+//   12..20 -- 9 bits of level-0 index.
+//    0..12 -- 12 bits of byte offset within the page.
+pte_t *
+walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+  return walkto(pagetable, va, alloc, 0);
+}
+
+// Physical address of the page holding va, given the leaf
+// PTE that maps it.
+static uint64
+leafpa(pte_t pte, uint64 va)
+{
+  if(pte & PTE_MEGA)
+    return PTE2PA(pte) + PGROUNDDOWN(va % MEGASIZE);
+  return PTE2PA(pte);
+}
+
+// Replace the megapage PTE *pte with a page-table page of
+// PTEs that map the same pages with the same permissions,
+// so that they can be changed one at a time. The megapage's
+// references to its pages become those of the new PTEs.
+// The caller must flush the TLB.
+// Returns 0 on success, -1 if memory is exhausted.
+static int
+megasplit(pte_t *pte)
+{
+  pagetable_t pagetable;
+  uint64 pa;
+  uint flags;
+
+  if((pagetable = (pagetable_t)kalloc()) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = PTE_FLAGS(*pte) & ~PTE_MEGA;
+  for(int i = 0; i < 512; i++)
+    pagetable[i] = PA2PTE(pa + i*PGSIZE) | flags;
+  *pte = PA2PTE(pagetable) | PTE_V;
+  return 0;
 }
 
 // Look up a virtual address, return the physical address,
-// or 0 if not mapped.
+// or 0 if not mapped. A page of the current process that
+// has not been touched yet gets faulted in first.
 // Can only be used to look up user pages.
 uint64
 walkaddr(pagetable_t pagetable, uint64 va)
 {
+  struct proc *p = myproc();
   pte_t *pte;
   uint64 pa;
 
@@ -108,23 +253,27 @@ walkaddr(pagetable_t pagetable, uint64 va)
     return 0;
 
   pte = walk(pagetable, va, 0);
+  if((pte == 0 || (*pte & PTE_V) == 0) && p && p->pagetable == pagetable &&
+     vmfault(p, va, PTE_R) == 0)
+    pte = walk(pagetable, va, 0);
   if(pte == 0)
     return 0;
   if((*pte & PTE_V) == 0)
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;
-  pa = PTE2PA(*pte);
+  pa = leafpa(*pte, va);
   return pa;
 }
 
 // add a mapping to the kernel page table.
 // only used when booting.
 // does not flush TLB or enable paging.
+// the mapping is global, since every page table has it.
 void
 kvmmap(uint64 va, uint64 pa, uint64 sz, int perm)
 {
-  if(mappages(kernel_pagetable, va, sz, pa, perm) != 0)
+  if(mappages(kernel_pagetable, va, sz, pa, perm | PTE_G) != 0)
     panic("kvmmap");
 }
 
@@ -144,78 +293,154 @@ kvmpa(uint64 va)
     panic("kvmpa");
   if((*pte & PTE_V) == 0)
     panic("kvmpa");
-  pa = PTE2PA(*pte);
+  pa = leafpa(*pte, va);
   return pa+off;
 }
 
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
-// be page-aligned. Returns 0 on success, -1 if walk() couldn't
+// be page-aligned. With PTE_MEGA in perm, each megapage-aligned
+// run of MEGASIZE bytes whose pa is aligned too gets a single
+// megapage PTE. Returns 0 on success, -1 if walk() couldn't
 // allocate a needed page-table page.
 int
 mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 {
-  uint64 a, last;
+  uint64 a, last, sz;
   pte_t *pte;
 
   a = PGROUNDDOWN(va);
   last = PGROUNDDOWN(va + size - 1);
   for(;;){
-    if((pte = walk(pagetable, a, 1)) == 0)
+    pte = 0;
+    sz = MEGASIZE;
+    if((perm & PTE_MEGA) && a % MEGASIZE == 0 && pa % MEGASIZE == 0 &&
+       last - a >= MEGASIZE - PGSIZE)
+      pte = walkto(pagetable, a, 1, 1);
+    if(pte == 0 || (*pte & (PTE_V|PTE_MEGA)) == PTE_V){
+      // no megapage here, or a page-table page is in the way.
+      pte = walk(pagetable, a, 1);
+      sz = PGSIZE;
+    }
+    if(pte == 0)
       return -1;
     if(*pte & PTE_V)
       panic("remap");
-    *pte = PA2PTE(pa) | perm | PTE_V;
-    if(a == last)
+    *pte = PA2PTE(pa) | (sz == MEGASIZE ? perm : perm & ~PTE_MEGA) | PTE_V;
+    if(last - a < sz)
       break;
-    a += PGSIZE;
-    pa += PGSIZE;
+    a += sz;
+    pa += sz;
   }
   return 0;
 }
 
-// Remove mappings from a page table. The mappings in
-// the given range must exist. Optionally free the
-// physical memory.
+// Remove mappings from a page table. Pages in the
+// given range that were never touched have no mapping,
+// and are skipped. A megapage that lies only partly in
+// the range is split first. Optionally free the physical
+// memory, and the swap slots of swapped-out pages.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 size, int do_free)
 {
-  uint64 a, last;
+  uint64 a, last, sz;
   pte_t *pte;
   uint64 pa;
 
   a = PGROUNDDOWN(va);
   last = PGROUNDDOWN(va + size - 1);
   for(;;){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
-    if((*pte & PTE_V) == 0){
-      printf("va=%p pte=%p\n", a, *pte);
-      panic("uvmunmap: not mapped");
-    }
-    if(PTE_FLAGS(*pte) == PTE_V)
-      panic("uvmunmap: not a leaf");
-    if(do_free){
-      pa = PTE2PA(*pte);
-      kfree((void*)pa);
+    sz = PGSIZE;
+    push_off();  // so that swapout() can't take the page meanwhile
+    if((pte = walk(pagetable, a, 0)) != 0 && PTE_SWAPPED(*pte)){
+      if(do_free)
+        swapfree(PTE2SLOT(*pte));
+      *pte = 0;
+    } else if(pte != 0 && (*pte & PTE_V) != 0){
+      if(PTE_FLAGS(*pte) == PTE_V)
+        panic("uvmunmap: not a leaf");
+      if((*pte & PTE_MEGA) && (a % MEGASIZE != 0 || last - a < MEGASIZE - PGSIZE)){
+        if(megasplit(pte) != 0)
+          panic("uvmunmap: split");
+        pte = walk(pagetable, a, 0);
+      }
+      if(*pte & PTE_MEGA)
+        sz = MEGASIZE;
+      if(do_free){
+        pa = PTE2PA(*pte);
+        for(uint64 off = 0; off < sz; off += PGSIZE)
+          kfree((void*)(pa + off));
+      }
+      *pte = 0;
+      if(last - PGROUNDDOWN(va) < TLBFLUSHMAX*PGSIZE)
+        tlbflush(pagetable, a);
     }
-    *pte = 0;
-    if(a == last)
+    pop_off();
+    if(last - a < sz)
       break;
-    a += PGSIZE;
-    pa += PGSIZE;
+    a += sz;
+  }
+  if(last - PGROUNDDOWN(va) >= TLBFLUSHMAX*PGSIZE)
+    tlbflushall(pagetable);
+}
+
+// Map the kernel's devices and RAM in user page table
+// pagetable, without PTE_U, by sharing the kernel's page-table
+// pages. The devices share their gigabyte with the heap, so
+// their entries are copied into a page-table page of the
+// user's own. The top gigabyte, with the trampoline and the
+// kernel stacks, is left to proc_pagetable().
+static void
+kvmshare(pagetable_t pagetable)
+{
+  pagetable_t heap;
+
+  for(int i = 0; i < PX(2, TRAMPOLINE); i++){
+    if((kernel_pagetable[i] & PTE_V) == 0)
+      continue;
+    if(i == PX(2, HEAPTOP - 1)){
+      if((heap = (pagetable_t)kalloc()) == 0)
+        panic("uvmcreate: out of memory");
+      memmove(heap, (void*)PTE2PA(kernel_pagetable[i]), PGSIZE);
+      pagetable[i] = PA2PTE(heap) | PTE_V;
+    } else {
+      pagetable[i] = kernel_pagetable[i];
+    }
+  }
+}
+
+// Remove what kvmshare() added, so that freewalk() finds
+// only the user's own page-table pages.
+static void
+kvmunshare(pagetable_t pagetable)
+{
+  pagetable_t heap, kheap;
+
+  for(int i = 0; i < PX(2, TRAMPOLINE); i++){
+    if((kernel_pagetable[i] & PTE_V) == 0)
+      continue;
+    if(i == PX(2, HEAPTOP - 1)){
+      heap = (pagetable_t)PTE2PA(pagetable[i]);
+      kheap = (pagetable_t)PTE2PA(kernel_pagetable[i]);
+      for(int j = 0; j < 512; j++)
+        if(heap[j] == kheap[j])
+          heap[j] = 0;
+    } else {
+      pagetable[i] = 0;
+    }
   }
 }
 
-// create an empty user page table.
+// create an empty user page table, which maps the kernel
+// too; see kvmshare().
 pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kalloc_zeroed();
   if(pagetable == 0)
     panic("uvmcreate: out of memory");
-  memset(pagetable, 0, PGSIZE);
+  kvmshare(pagetable);
   return pagetable;
 }
 
@@ -229,34 +454,44 @@ uvminit(pagetable_t pagetable, uchar *src, uint sz)
 
   if(sz >= PGSIZE)
     panic("inituvm: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
 }
 
 // Allocate PTEs and physical memory to grow process from oldsz to
-// newsz, which need not be page aligned.  Returns new size or 0 on error.
+// newsz, which need not be page aligned.  Whole megapages of the
+// new memory get megapages when the pool has them. If memory
+// is exhausted, other pages are swapped out to make room.
+// Returns new size or 0 on error.
 uint64
 uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 {
   char *mem;
-  uint64 a;
+  uint64 a, sz;
 
   if(newsz < oldsz)
     return oldsz;
 
   oldsz = PGROUNDUP(oldsz);
   a = oldsz;
-  for(; a < newsz; a += PGSIZE){
-    mem = kalloc();
+  for(; a < newsz; a += sz){
+    sz = PGSIZE;
+    mem = 0;
+    if(a % MEGASIZE == 0 && newsz - a >= MEGASIZE && (mem = kallocmega()) != 0){
+      sz = MEGASIZE;
+      memset(mem, 0, sz);
+    } else {
+      while((mem = kalloc_zeroed()) == 0 && swapreclaim())
+        ;
+    }
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
-    if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
-      kfree(mem);
+    if(mappages(pagetable, a, sz, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U|PTE_MEGA) != 0){
+      for(uint64 off = 0; off < sz; off += PGSIZE)
+        kfree(mem + off);
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
@@ -282,14 +517,15 @@ uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 }
 
 // Recursively free page-table pages.
-// All leaf mappings must already have been removed.
+// All leaf mappings, megapages included, must already have
+// been removed.
 static void
 freewalk(pagetable_t pagetable)
 {
   // there are 2^9 = 512 PTEs in a page table.
   for(int i = 0; i < 512; i++){
     pte_t pte = pagetable[i];
-    if((pte & PTE_V) && (pte & (PTE_R|PTE_W|PTE_X)) == 0){
+    if((pte & PTE_V) && (pte & (PTE_R|PTE_W|PTE_X|PTE_MEGA)) == 0){
       // this PTE points to a lower-level page table.
       uint64 child = PTE2PA(pte);
       freewalk((pagetable_t)child);
@@ -306,47 +542,200 @@ freewalk(pagetable_t pagetable)
 void
 uvmfree(pagetable_t pagetable, uint64 sz)
 {
-  uvmunmap(pagetable, 0, sz, 1);
+  if(sz > 0)
+    uvmunmap(pagetable, 0, sz, 1);
+  kvmunshare(pagetable);
   freewalk(pagetable);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Given a parent process's page table, share
+// its memory from start to end with a child's page table.
+// Unless share is set, writable pages become read-only
+// and PTE_COW in both, so that the first store to one
+// copies it; see uvmcow(). A megapage that lies wholly in
+// the range stays a megapage in both. A page in swap stays
+// there, and both PTEs name its slot.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
-uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+uvmcopy(pagetable_t old, pagetable_t new, uint64 start, uint64 end, int share)
 {
-  pte_t *pte;
-  uint64 pa, i;
+  pte_t *pte, *npte;
+  uint64 pa, i, sz, off;
   uint flags;
-  char *mem;
 
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+  for(i = start; i < end; i += sz){
+    sz = PGSIZE;
+    push_off();  // so that swapout() can't take the page meanwhile
+    if((pte = walk(old, i, 0)) != 0 && PTE_SWAPPED(*pte)){
+      if((npte = walk(new, i, 1)) == 0){
+        pop_off();
+        goto err;
+      }
+      swapdup(PTE2SLOT(*pte));
+      *npte = *pte;
+      pop_off();
+      continue;
+    }
+    if(pte == 0 || (*pte & PTE_V) == 0){
+      pop_off();
+      continue;  // never touched; the child will fault it in too
+    }
+    if((*pte & PTE_MEGA) && (i % MEGASIZE != 0 || end - i < MEGASIZE)){
+      if(megasplit(pte) != 0){
+        pop_off();
+        goto err;
+      }
+      pte = walk(old, i, 0);
+    }
+    if(*pte & PTE_MEGA)
+      sz = MEGASIZE;
+    if((*pte & PTE_W) && !share)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
+    if(mappages(new, i, sz, pa, flags) != 0){
+      pop_off();
       goto err;
     }
+    for(off = 0; off < sz; off += PGSIZE)
+      kref((void*)(pa + off));
+    pop_off();
   }
+  // the parent may have writable entries in the TLB.
+  tlbflushall(old);
   return 0;
 
  err:
-  uvmunmap(new, 0, i, 1);
+  tlbflushall(old);
+  if(i > start)
+    uvmunmap(new, start, i - start, 1);
+  return -1;
+}
+
+// Map a zeroed page at va, in the heap below sz but never
+// touched. sbrk() only moves p->sz; heap pages appear on
+// the first page fault, or copyin()/copyout(), at them.
+// If mega is set, nothing else lives in va's megapage, and
+// all of it is heap and untouched, a whole zeroed megapage
+// is mapped there instead, if the pool has one.
+// returns 0 on success, -1 if va is not such a page, or
+// -2 if memory is exhausted.
+int
+uvmlazy(pagetable_t pagetable, uint64 va, uint64 sz, int mega)
+{
+  pte_t *pte;
+  char *mem;
+  uint64 base;
+
+  if(va >= sz || va >= MAXVA)
+    return -1;
+  va = PGROUNDDOWN(va);
+  if((pte = walk(pagetable, va, 0)) != 0 && *pte != 0)
+    return -1;  // mapped, or in swap
+  base = MEGAROUNDDOWN(va);
+  if(mega && sz - base >= MEGASIZE &&
+     ((pte = walkto(pagetable, base, 0, 1)) == 0 || *pte == 0) &&
+     (mem = kallocmega()) != 0){
+    memset(mem, 0, MEGASIZE);
+    if(mappages(pagetable, base, MEGASIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U|PTE_MEGA) != 0){
+      for(uint64 off = 0; off < MEGASIZE; off += PGSIZE)
+        kfree(mem + off);
+      return -2;
+    }
+    return 0;
+  }
+  if((mem = kalloc_zeroed()) == 0)
+    return -2;
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
+    kfree(mem);
+    return -2;
+  }
+  return 0;
+}
+
+// Give the page at va in pagetable a private, writable
+// copy of a copy-on-write page, after a store fault or
+// before copyout() writes to it. The last sharer of a
+// page just takes it over.
+// returns 0 on success, -1 if va is not a copy-on-write
+// user page, or -2 if memory is exhausted.
+int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  push_off();  // so that swapout() can't take the page meanwhile
+  if((pte = walk(pagetable, va, 0)) == 0)
+    goto bad;
+  if((*pte & (PTE_V|PTE_U|PTE_COW)) != (PTE_V|PTE_U|PTE_COW))
+    goto bad;
+  if(*pte & PTE_MEGA){
+    // copy just the page that is written to.
+    if(megasplit(pte) != 0)
+      goto nomem;
+    pte = walk(pagetable, va, 0);
+  }
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+  if(krefcnt((void*)pa) == 1){
+    *pte = PA2PTE(pa) | flags;
+    tlbflush(pagetable, va);
+    pop_off();
+    return 0;
+  }
+  if((mem = kalloc()) == 0)
+    goto nomem;
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  tlbflush(pagetable, va);
+  kfree((void*)pa);
+  pop_off();
+  return 0;
+
+ bad:
+  pop_off();
   return -1;
+
+ nomem:
+  pop_off();
+  return -2;
+}
+
+// Read the page at va in pagetable back in from swap.
+// The caller must be able to sleep.
+// returns 0 on success, -1 if va is not in swap, or -2
+// if memory is exhausted.
+int
+uvmswapin(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 slot;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  if((pte = walk(pagetable, va, 0)) == 0 || !PTE_SWAPPED(*pte))
+    return -1;
+  // only this process changes a PTE that is not valid,
+  // so *pte stays put while swapread() sleeps.
+  slot = PTE2SLOT(*pte);
+  if((mem = swapread(slot)) == 0)
+    return -2;
+  *pte = PA2PTE(mem) | PTE_FLAGS(*pte) | PTE_V | PTE_A;
+  swapfree(slot);
+  return 0;
 }
 
-// mark a PTE invalid for user access.
+// mark a PTE invalid for user access, and for the
+// kernel's copyin() and copyout(), which access user
+// memory without walking the page table: an
+// execute-only page faults on loads and stores.
 // used by exec for the user stack guard page.
 void
 uvmclear(pagetable_t pagetable, uint64 va)
@@ -356,7 +745,55 @@ uvmclear(pagetable_t pagetable, uint64 va)
   pte = walk(pagetable, va, 0);
   if(pte == 0)
     panic("uvmclear");
-  *pte &= ~PTE_U;
+  if((*pte & PTE_MEGA) && (megasplit(pte) != 0 || (pte = walk(pagetable, va, 0)) == 0))
+    panic("uvmclear");
+  *pte = (*pte & ~(PTE_U|PTE_R|PTE_W)) | PTE_X;
+  tlbflush(pagetable, va);
+}
+
+// How many bytes from user address va can the copy routines
+// reach with copyuser(), through the page table in satp? Only
+// if pagetable is the current process's, and only up to the
+// end of the heap or vma holding va; the kernel's own
+// mappings lie outside those.
+static uint64
+ucopylen(pagetable_t pagetable, uint64 va)
+{
+  struct proc *p = myproc();
+  uint64 end;
+
+  if(p == 0 || p->pagetable != pagetable)
+    return 0;
+  if((end = vmaend(p, va)) == 0)
+    return 0;
+  return end - va;
+}
+
+// Return the physical address of user address va in
+// pagetable, for the copy routines' slow path, faulting the
+// page in if need be and, for a write, copying it if it is
+// copy-on-write. Returns with interrupts off, so that
+// swapout() can't take the page before the caller's
+// pop_off(). Returns 0, with interrupts left alone, if va
+// is not mapped.
+static uint64
+pinaddr(pagetable_t pagetable, uint64 va, int write)
+{
+  pte_t *pte;
+
+  for(;;){
+    if(walkaddr(pagetable, va) == 0)
+      return 0;
+    pte = walk(pagetable, va, 0);
+    if(write && (*pte & PTE_COW) && uvmcow(pagetable, va) != 0)
+      return 0;
+    push_off();
+    pte = walk(pagetable, va, 0);
+    if(pte && (*pte & (PTE_V|PTE_U)) == (PTE_V|PTE_U) &&
+       !(write && (*pte & PTE_COW)))
+      return leafpa(*pte, va);
+    pop_off();  // swapped out meanwhile; try again
+  }
 }
 
 // Copy from kernel to user.
@@ -366,16 +803,27 @@ int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
   uint64 n, va0, pa0;
+  int r;
+
+  if(len > 0 && len <= ucopylen(pagetable, dstva)){
+    w_sstatus(r_sstatus() | SSTATUS_SUM);
+    r = copyuser((void*)dstva, src, len);
+    w_sstatus(r_sstatus() & ~SSTATUS_SUM);
+    return r;
+  }
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
+    if(va0 >= MAXVA)
+      return -1;
+    pa0 = pinaddr(pagetable, va0, 1);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
     memmove((void *)(pa0 + (dstva - va0)), src, n);
+    pop_off();
 
     len -= n;
     src += n;
@@ -391,16 +839,25 @@ int
 copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
   uint64 n, va0, pa0;
+  int r;
+
+  if(len > 0 && len <= ucopylen(pagetable, srcva)){
+    w_sstatus(r_sstatus() | SSTATUS_SUM);
+    r = copyuser(dst, (void*)srcva, len);
+    w_sstatus(r_sstatus() & ~SSTATUS_SUM);
+    return r;
+  }
 
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = pinaddr(pagetable, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > len)
       n = len;
     memmove(dst, (void *)(pa0 + (srcva - va0)), n);
+    pop_off();
 
     len -= n;
     dst += n;
@@ -419,9 +876,21 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
   uint64 n, va0, pa0;
   int got_null = 0;
 
+  if((n = ucopylen(pagetable, srcva)) > 0){
+    w_sstatus(r_sstatus() | SSTATUS_SUM);
+    got_null = copyuserstr(dst, (char*)srcva, n < max ? n : max) == 0;
+    w_sstatus(r_sstatus() & ~SSTATUS_SUM);
+    // a string that runs past the heap or vma, or faults,
+    // takes the slow way.
+    if(got_null || n >= max)
+      return got_null ? 0 : -1;
+  }
+
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    if(va0 >= MAXVA)
+      return -1;
+    pa0 = pinaddr(pagetable, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
@@ -442,6 +911,7 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
       p++;
       dst++;
     }
+    pop_off();
 
     srcva = va0 + PGSIZE;
   }
@@ -0,0 +1,455 @@
+// File-backed user memory.
+//
+// exec() does not read a program into memory. It records
+// each loadable segment as a vma of the process, and the
+// page fault handler reads a page in from the program's
+// inode the first time the program touches it.
+//
+// mmap() adds vmas too: anonymous ones, and private or
+// shared views of a file. munmap() and exit() write a shared
+// mapping's dirty pages back to the file.
+//
+// Interface:
+// * vmaadd() records a range; vmaunmap() removes part of
+//     a process's ranges; vmafree() drops them all.
+// * vmadup() gives a forked child the parent's ranges;
+//     vmaprefork() first faults in the shared ones.
+// * vmfault() resolves a page fault at a user address;
+//     vmtouch() faults in a range before it is copied.
+//
+// Whole pages of a private file mapping come from the page
+// cache (pcache.c), so that all processes running the same
+// program map the same physical pages, read-only, and
+// copy-on-write if the segment is writable.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "defs.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+// Record that len bytes at addr in p read as filesz bytes
+// of ip at off, then zeros, with permissions perm. ip may
+// be 0, for memory that starts out zeroed. With VMA_SHARED
+// in flags, stores to the memory are written back to ip.
+// Takes a new reference to ip.
+// Returns 0 on success, -1 if p has no free vma.
+int
+vmaadd(struct proc *p, uint64 addr, uint64 len, int perm, int flags,
+       struct inode *ip, uint off, uint filesz)
+{
+  struct vma *v;
+
+  if(addr % PGSIZE != 0 || len == 0)
+    panic("vmaadd");
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len == 0){
+      v->addr = addr;
+      v->len = len;
+      v->perm = perm;
+      v->flags = flags;
+      v->ip = ip ? idup(ip) : 0;
+      v->off = off;
+      v->filesz = filesz;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Write back the dirty pages of shared vma v between
+// va and va+len, which are page-aligned.
+static void
+vmasync(struct proc *p, struct vma *v, uint64 va, uint64 len)
+{
+  pte_t *pte;
+  uint64 a, d;
+  uint n;
+
+  for(a = va; a < va + len; a += PGSIZE){
+    pte = walk(p->pagetable, a, 0);
+    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_D) == 0)
+      continue;
+    d = a - v->addr;
+    if(d >= v->filesz)
+      break;
+    n = min(PGSIZE, v->filesz - d);
+    // one page per transaction, like filewrite().
+    begin_op(ROOTDEV);
+    ilock(v->ip);
+    if(v->off + d < v->ip->size){
+      n = min(n, v->ip->size - (v->off + d));
+      writei(v->ip, 0, PTE2PA(*pte), v->off + d, n);
+    }
+    iunlock(v->ip);
+    end_op(ROOTDEV);
+  }
+}
+
+// Remove the part of vma v that lies between va and va+len,
+// which are page-aligned: write back its dirty pages if v
+// is shared, unmap and free them, and shrink or split v,
+// or free it if nothing is left.
+// Returns 0 on success, -1 if a split needs a vma that p
+// does not have.
+static int
+vmacut(struct proc *p, struct vma *v, uint64 va, uint64 len)
+{
+  uint64 end, vend, cut;
+  struct inode *ip;
+
+  end = va + len;
+  vend = PGROUNDUP(v->addr + v->len);
+  if(va < v->addr)
+    va = v->addr;
+  if(end > vend)
+    end = vend;
+  if(va >= end)
+    return 0;
+
+  if(va > v->addr && end < vend){
+    // split off the part after end first.
+    cut = end - v->addr;
+    if(vmaadd(p, end, v->addr + v->len - end, v->perm, v->flags, v->ip,
+              v->off + cut, v->filesz > cut ? v->filesz - cut : 0) < 0)
+      return -1;
+    v->len = end - v->addr;
+    vend = end;
+  }
+
+  if(v->ip && (v->flags & VMA_SHARED))
+    vmasync(p, v, va, end - va);
+  uvmunmap(p->pagetable, va, end - va, 1);
+
+  if(va == v->addr && end == vend){
+    ip = v->ip;
+    v->len = 0;
+    v->ip = 0;
+    if(ip){
+      begin_op(ROOTDEV);
+      iput(ip);
+      end_op(ROOTDEV);
+    }
+  } else if(va == v->addr){
+    cut = end - v->addr;
+    v->addr = end;
+    v->len -= cut;
+    v->off += cut;
+    v->filesz = v->filesz > cut ? v->filesz - cut : 0;
+  } else {
+    v->len = va - v->addr;
+    v->filesz = min(v->filesz, v->len);
+  }
+  return 0;
+}
+
+// Remove p's memory between va and va+len, which are
+// page-aligned, from whatever vmas hold it.
+// Returns 0 on success, -1 on error.
+int
+vmaunmap(struct proc *p, uint64 va, uint64 len)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len && vmacut(p, v, va, len) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+// Drop all of p's vmas and unmap their memory, writing
+// back the shared ones. Must not be called inside a
+// transaction, since it starts its own.
+void
+vmafree(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len)
+      vmacut(p, v, v->addr, PGROUNDUP(v->len));
+  }
+}
+
+// Fault in every page of p's shared mappings, so that
+// vmadup() can give a child the same physical pages; one
+// the child faulted in later would be its own.
+// Returns 0 on success, -1 if memory is exhausted.
+int
+vmaprefork(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len && (v->flags & VMA_SHARED) &&
+       vmtouch(p, v->addr, v->len, (v->perm & PTE_W) ? PTE_W : PTE_R) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+// Give child np copies of p's vmas, and of the memory of
+// those above p->sz, which uvmcopy() of the heap does not
+// reach. Pages of shared mappings stay writable in both;
+// the rest become copy-on-write. Caller holds np->lock.
+// Returns 0 on success, -1 if memory is exhausted.
+int
+vmadup(struct proc *np, struct proc *p)
+{
+  struct vma *v;
+  int i;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len && v->addr >= p->sz &&
+       uvmcopy(p->pagetable, np->pagetable, v->addr, PGROUNDUP(v->addr + v->len),
+               (v->flags & VMA_SHARED) != 0) < 0)
+      goto err;
+  }
+  for(i = 0; i < NVMA; i++){
+    np->vma[i] = p->vma[i];
+    if(p->vma[i].ip)
+      idup(p->vma[i].ip);
+  }
+  return 0;
+
+ err:
+  while(--v >= p->vma){
+    if(v->len && v->addr >= p->sz)
+      uvmunmap(np->pagetable, v->addr, PGROUNDUP(v->len), 1);
+  }
+  return -1;
+}
+
+// Find the vma of p holding va, if any. A vma covers
+// the whole of its last page.
+static struct vma*
+vmalookup(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len && va >= v->addr && va < PGROUNDUP(v->addr + v->len))
+      return v;
+  }
+  return 0;
+}
+
+// Does any of p's vmas overlap va..va+len?
+static int
+vmaoverlap(struct proc *p, uint64 va, uint64 len)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len && v->addr < va + len && PGROUNDUP(v->addr + v->len) > va)
+      return 1;
+  }
+  return 0;
+}
+
+// Return the end of p's heap, if va is in it, or of the
+// vma holding va; 0 if va is not in p's memory.
+uint64
+vmaend(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  if(va < p->sz)
+    return p->sz;
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len && va >= v->addr && va < v->addr + v->len)
+      return v->addr + v->len;
+  }
+  return 0;
+}
+
+// Return the lowest address of any vma above sz, or
+// USERTOP if there is none: mmap() places new memory
+// just below it.
+uint64
+vmabase(struct proc *p, uint64 sz)
+{
+  struct vma *v;
+  uint64 base = USERTOP;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len && v->addr >= sz && v->addr < base)
+      base = v->addr;
+  }
+  return base;
+}
+
+// Read in and map the page of vma v that holds va.
+// A whole page of a private file mapping comes from the
+// page cache. Bytes past the end of the file read as zeros.
+// Returns 0 on success, -1 on error, or -2 if memory is
+// exhausted.
+static int
+vmaload(struct proc *p, struct vma *v, uint64 va)
+{
+  uint64 d;
+  uint n;
+  int perm;
+  char *mem;
+
+  va = PGROUNDDOWN(va);
+  d = va - v->addr;
+
+  // reading the file sleeps, which a caller holding a spinlock
+  // must not do, and locks v->ip, which the caller may hold:
+  // a read() into the program's own data. fileread() and
+  // filewrite() fault their buffers in with vmtouch() first.
+  if(v->ip && d < v->filesz && (holdingany() || holdingsleep(&v->ip->lock)))
+    return -1;
+
+  if(v->ip && !(v->flags & VMA_SHARED) && d + PGSIZE <= v->filesz){
+    ilock(v->ip);
+    mem = 0;
+    if(v->off + d + PGSIZE <= v->ip->size)
+      mem = ipage(v->ip, v->off + d);
+    iunlock(v->ip);
+    if(mem){
+      perm = v->perm & ~PTE_W;
+      if(v->perm & PTE_W)
+        perm |= PTE_COW;
+      if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, perm|PTE_U) != 0){
+        kfree(mem);
+        return -2;
+      }
+      return 0;
+    }
+  }
+
+  if((mem = kalloc_zeroed()) == 0)
+    return -2;
+  if(v->ip && d < v->filesz){
+    n = min(PGSIZE, v->filesz - d);
+    ilock(v->ip);
+    if(v->off + d < v->ip->size)
+      readi(v->ip, 0, (uint64)mem, v->off + d, n);
+    iunlock(v->ip);
+  }
+  if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, v->perm|PTE_U) != 0){
+    kfree(mem);
+    return -2;
+  }
+  return 0;
+}
+
+// Do p's PTEs allow access, PTE_R or PTE_W, to all the
+// pages that the n bytes at va cover?
+int
+vmmapped(struct proc *p, uint64 va, uint64 n, int access)
+{
+  uint64 a;
+  pte_t *pte;
+  int perm = PTE_V|PTE_U|access;
+
+  for(a = PGROUNDDOWN(va); a < va + n; a += PGSIZE){
+    if(a >= MAXVA || (pte = walk(p->pagetable, a, 0)) == 0 || (*pte & perm) != perm)
+      return 0;
+  }
+  return 1;
+}
+
+// Fault in the pages of p that the n bytes at va cover,
+// unless they already allow access, so that copying to or
+// from them while holding a lock will not fault.
+// Returns 0, or -1 if some page cannot be faulted in;
+// the copy will fail there.
+int
+vmtouch(struct proc *p, uint64 va, uint64 n, int access)
+{
+  uint64 a;
+
+  for(a = PGROUNDDOWN(va); a < va + n; a += PGSIZE){
+    if(a >= MAXVA)
+      return -1;
+    if(!vmmapped(p, a, 1, access) && vmfault(p, a, access) != 0)
+      return -1;
+  }
+  return 0;
+}
+
+// Return the lowest address at or above va of p's memory
+// that only p's page table refers to: the heap, and vmas
+// other than shared mappings of a file. Sets *end to the
+// end of the range holding it. Returns MAXVA if there is
+// none. Caller holds p->lock.
+uint64
+vmaprivate(struct proc *p, uint64 va, uint64 *end)
+{
+  struct vma *v;
+  uint64 a = MAXVA, vend;
+
+  va = PGROUNDDOWN(va);
+  if(va < p->sz){
+    *end = PGROUNDUP(p->sz);
+    return va;
+  }
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len == 0 || (v->ip && (v->flags & VMA_SHARED)))
+      continue;
+    vend = PGROUNDUP(v->addr + v->len);
+    if(vend > va && (v->addr > va ? v->addr : va) < a){
+      a = v->addr > va ? v->addr : va;
+      *end = vend;
+    }
+  }
+  return a;
+}
+
+// Resolve a page fault, as vmfault() describes.
+// Returns 0 on success, -1 on error, or -2 if memory
+// is exhausted.
+static int
+vmresolve(struct proc *p, uint64 va, int access)
+{
+  pte_t *pte;
+  struct vma *v;
+
+  if(va >= MAXVA)
+    return -1;
+  pte = walk(p->pagetable, va, 0);
+  if(pte && (*pte & (PTE_V|PTE_U|access)) == (PTE_V|PTE_U|access)){
+    sfence_vma_va(va, p->asid);
+    return 0;
+  }
+  if(pte && PTE_SWAPPED(*pte))
+    return holdingany() ? -1 : uvmswapin(p->pagetable, va);
+  if(pte && (*pte & PTE_V))
+    return access == PTE_W ? uvmcow(p->pagetable, va) : -1;
+  if((v = vmalookup(p, va)) != 0)
+    return vmaload(p, v, va);
+  return uvmlazy(p->pagetable, va, p->sz,
+                 !vmaoverlap(p, MEGAROUNDDOWN(va), MEGASIZE));
+}
+
+// Resolve a page fault at user address va in p, where
+// access, PTE_R, PTE_W or PTE_X, says what the faulting
+// access was: copy a copy-on-write page, read a page back
+// in from swap, read in a page of a vma, or map a zeroed
+// heap page, or a whole megapage of heap if no vma shares
+// it. If the page table already allows the access, the TLB
+// held a stale entry for va, since mappings are not flushed
+// from it when they appear. If memory is exhausted, other
+// pages are swapped out to make room.
+// Returns 0 if the access can be retried, -1 if it is
+// an error or memory is exhausted.
+int
+vmfault(struct proc *p, uint64 va, int access)
+{
+  int r;
+
+  while((r = vmresolve(p, va, access)) == -2 && swapreclaim())
+    ;
+  return r == 0 ? 0 : -1;
+}
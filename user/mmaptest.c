@@ -0,0 +1,226 @@
+//
+// tests for mmap() and munmap().
+//
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define PGSIZE 4096
+#define MAP_FAILED ((char*)0xffffffffffffffffL)
+
+char buf[PGSIZE];
+
+void
+err(char *why)
+{
+  printf("mmaptest: %s failed\n", why);
+  exit(1);
+}
+
+// make a file of two and a half pages, page i full of 'a'+i.
+void
+makefile(char *name)
+{
+  int fd, i;
+
+  unlink(name);
+  if((fd = open(name, O_RDWR | O_CREATE)) < 0)
+    err("open");
+  for(i = 0; i < 3; i++){
+    memset(buf, 'a' + i, PGSIZE);
+    if(write(fd, buf, i < 2 ? PGSIZE : PGSIZE/2) < 0)
+      err("write");
+  }
+  close(fd);
+}
+
+// check that p holds makefile()'s contents, with zeros
+// after the end of the file.
+void
+checkfile(char *p)
+{
+  int i;
+
+  for(i = 0; i < 3*PGSIZE; i++){
+    char want = i < 2*PGSIZE + PGSIZE/2 ? 'a' + i/PGSIZE : 0;
+    if(p[i] != want){
+      printf("mmaptest: byte %d is %d, not %d\n", i, p[i], want);
+      exit(1);
+    }
+  }
+}
+
+void
+privatetest()
+{
+  char *p;
+  int fd;
+
+  printf("private: ");
+  makefile("mmap.private");
+  if((fd = open("mmap.private", O_RDONLY)) < 0)
+    err("open");
+  p = mmap(0, 3*PGSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(p == MAP_FAILED)
+    err("mmap");
+  close(fd);
+  checkfile(p);
+
+  // stores stay private.
+  p[0] = 'z';
+  if(munmap(p, 3*PGSIZE) < 0)
+    err("munmap");
+  if((fd = open("mmap.private", O_RDONLY)) < 0)
+    err("open");
+  if(read(fd, buf, 1) != 1 || buf[0] != 'a')
+    err("private store");
+  close(fd);
+  printf("ok\n");
+}
+
+// a write() to a file must not change a private mapping of
+// it that another process has already faulted in.
+void
+writetest()
+{
+  char *p, c;
+  int fd, pid, xstatus, toparent[2], tochild[2];
+
+  printf("write under private mapping: ");
+  makefile("mmap.write");
+  if(pipe(toparent) < 0 || pipe(tochild) < 0)
+    err("pipe");
+  if((pid = fork()) < 0)
+    err("fork");
+  if(pid == 0){
+    if((fd = open("mmap.write", O_RDONLY)) < 0)
+      exit(1);
+    p = mmap(0, PGSIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(p == MAP_FAILED)
+      exit(1);
+    close(fd);
+    if(p[0] != 'a')
+      exit(1);
+    write(toparent[1], "x", 1);
+    if(read(tochild[0], &c, 1) != 1)
+      exit(1);
+    exit(p[0] == 'a' && p[PGSIZE-1] == 'a' ? 0 : 1);
+  }
+  if(read(toparent[0], &c, 1) != 1)
+    err("read pipe");
+  if((fd = open("mmap.write", O_WRONLY)) < 0)
+    err("open");
+  if(write(fd, "b", 1) != 1)
+    err("write");
+  close(fd);
+  write(tochild[1], "x", 1);
+  wait(&xstatus);
+  if(xstatus != 0)
+    err("private mapping kept its contents");
+  if((fd = open("mmap.write", O_RDONLY)) < 0)
+    err("open");
+  if(read(fd, buf, 2) != 2 || buf[0] != 'b' || buf[1] != 'a')
+    err("file has the write");
+  close(fd);
+  close(toparent[0]);
+  close(toparent[1]);
+  close(tochild[0]);
+  close(tochild[1]);
+  printf("ok\n");
+}
+
+void
+sharedtest()
+{
+  char *p;
+  int fd, pid, xstatus;
+
+  printf("shared: ");
+  makefile("mmap.shared");
+  if((fd = open("mmap.shared", O_RDWR)) < 0)
+    err("open");
+  p = mmap(0, 3*PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == MAP_FAILED)
+    err("mmap");
+  close(fd);
+
+  // a child's stores show up in the parent's mapping, even
+  // in pages the parent had not touched before the fork.
+  if((pid = fork()) < 0)
+    err("fork");
+  if(pid == 0){
+    p[1] = 'q';
+    p[2*PGSIZE+1] = 'r';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0 || p[1] != 'q' || p[2*PGSIZE+1] != 'r')
+    err("child store seen by parent");
+  p[1] = 'a';
+  p[2*PGSIZE+1] = 'c';
+  checkfile(p);
+
+  // unmap the first page alone, then the rest; both halves
+  // must be written back.
+  p[0] = 'y';
+  p[PGSIZE] = 'x';
+  if(munmap(p, PGSIZE) < 0 || munmap(p + PGSIZE, 2*PGSIZE) < 0)
+    err("munmap");
+  if((fd = open("mmap.shared", O_RDONLY)) < 0)
+    err("open");
+  if(read(fd, buf, PGSIZE) != PGSIZE || buf[0] != 'y')
+    err("write back of first page");
+  if(read(fd, buf, PGSIZE) != PGSIZE || buf[0] != 'x')
+    err("write back of second page");
+  close(fd);
+  printf("ok\n");
+}
+
+void
+anontest()
+{
+  char *p;
+  int i, pid, xstatus;
+
+  printf("anonymous and fork: ");
+  p = mmap(0, 4*PGSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(p == MAP_FAILED)
+    err("mmap");
+  for(i = 0; i < 4*PGSIZE; i++){
+    if(p[i] != 0)
+      err("zero fill");
+  }
+  p[PGSIZE] = 42;
+
+  if((pid = fork()) < 0)
+    err("fork");
+  if(pid == 0){
+    if(p[PGSIZE] != 42)
+      exit(1);
+    p[PGSIZE] = 7;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    err("child read");
+  if(p[PGSIZE] != 42)
+    err("child store stays private");
+  if(munmap(p, 4*PGSIZE) < 0)
+    err("munmap");
+  printf("ok\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  privatetest();
+  writetest();
+  sharedtest();
+  anontest();
+
+  printf("ALL MMAP TESTS PASSED\n");
+
+  exit(0);
+}
@@ -24,6 +24,11 @@ char* sbrk(int);
 int sleep(int);
 int uptime(void);
 int ntas();
+void *mmap(void*, int, int, int, int, int);
+int munmap(void*, int);
+int setpriority(int, int);
+int getpriority(int);
+int nanosleep(uint64);
 int crash(const char*, int);
 int mount(char*, char *);
 int umount(char*);
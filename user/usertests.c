@@ -389,6 +389,120 @@ pipe1(char *s)
   }
 }
 
+// setpriority() and getpriority() accept only levels and
+// processes that exist. Under the MLFQ scheduler a priority
+// boost may move this process back to the top level at any
+// moment, so only the range of its level is certain.
+void
+priority(char *s)
+{
+  int pid = getpid();
+  int prio;
+
+  if(setpriority(pid, 2) != 0){
+    printf("%s: setpriority failed\n", s);
+    exit(1);
+  }
+  prio = getpriority(pid);
+  if(prio != 0 && prio != 2){
+    printf("%s: getpriority returned %d\n", s, prio);
+    exit(1);
+  }
+  if(setpriority(pid, -1) != -1 || setpriority(pid, 1000) != -1){
+    printf("%s: setpriority accepted a bad level\n", s);
+    exit(1);
+  }
+  if(setpriority(-1, 0) != -1 || getpriority(-1) != -1){
+    printf("%s: found process -1\n", s);
+    exit(1);
+  }
+  setpriority(pid, 0);
+}
+
+// under MLFQ, a CPU-bound process must sink below the top
+// level, and a priority boost must bring back a process that
+// was set to the bottom one. under round robin, levels are
+// only recorded: neither may change. the boost tells which
+// scheduler the kernel was booted with (sched=mlfq).
+void
+prioritydrop(char *s)
+{
+  int spinner, sleeper, i, prio, maxprio, mlfq;
+
+  spinner = fork();
+  if(spinner < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(spinner == 0)
+    for(;;)
+      ;
+  sleeper = fork();
+  if(sleeper < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(sleeper == 0){
+    sleep(1000);
+    exit(0);
+  }
+  if(setpriority(sleeper, 2) != 0){
+    printf("%s: setpriority failed\n", s);
+    exit(1);
+  }
+
+  // long enough for the spinner to use up two quanta,
+  // and for a boost to happen.
+  maxprio = 0;
+  for(i = 0; i < 25; i++){
+    sleep(1);
+    prio = getpriority(spinner);
+    if(prio > maxprio)
+      maxprio = prio;
+  }
+  mlfq = getpriority(sleeper) == 0;
+
+  kill(spinner);
+  kill(sleeper);
+  wait(0);
+  wait(0);
+
+  if(mlfq && maxprio == 0){
+    printf("%s: CPU-bound process stayed at level 0\n", s);
+    exit(1);
+  }
+  if(!mlfq && maxprio != 0){
+    printf("%s: round robin changed a level to %d\n", s, maxprio);
+    exit(1);
+  }
+}
+
+// short nanosleep()s must end near their deadlines, not at
+// the next clock tick, 100ms away.
+void
+nanosleeptest(char *s)
+{
+  int i, t0, t1;
+
+  if(nanosleep(0) != 0){
+    printf("%s: nanosleep(0) failed\n", s);
+    exit(1);
+  }
+  t0 = uptime();
+  for(i = 0; i < 40; i++){
+    if(nanosleep(5*1000*1000) != 0){
+      printf("%s: nanosleep failed\n", s);
+      exit(1);
+    }
+  }
+  t1 = uptime();
+  // 40 sleeps of 5ms are 2 ticks; one tick each would be 40.
+  if(t1 - t0 > 20){
+    printf("%s: 40 sleeps of 5ms took %d ticks\n", s, t1 - t0);
+    exit(1);
+  }
+}
+
 // meant to be run w/ at most two CPUs
 void
 preempt(char *s)
@@ -1382,6 +1496,101 @@ bigfile(char *s)
   unlink("bigfile.test");
 }
 
+// write blocks [from,to) of an extent file, each
+// stamped with its block number and round.
+static void
+extentwrite(char *s, int fd, int round, int from, int to)
+{
+  int b;
+
+  for(b = from; b < to; b++){
+    memset(buf, round, BSIZE);
+    ((int*)buf)[0] = b;
+    if(write(fd, buf, BSIZE) != BSIZE){
+      printf("%s: write extent block %d failed\n", s, b);
+      exit(1);
+    }
+  }
+}
+
+// check that the extent file holds exactly n blocks
+// written by extentwrite() in this round.
+static void
+extentcheck(char *s, int round, int n)
+{
+  int fd, b, i;
+
+  fd = open("extent.test", O_RDONLY);
+  if(fd < 0){
+    printf("%s: cannot open extent.test\n", s);
+    exit(1);
+  }
+  for(b = 0; b < n; b++){
+    if(read(fd, buf, BSIZE) != BSIZE){
+      printf("%s: read extent block %d failed\n", s, b);
+      exit(1);
+    }
+    if(((int*)buf)[0] != b){
+      printf("%s: extent block %d holds block %d\n", s, b, ((int*)buf)[0]);
+      exit(1);
+    }
+    for(i = sizeof(int); i < BSIZE; i++){
+      if(buf[i] != round){
+        printf("%s: extent block %d has wrong contents\n", s, b);
+        exit(1);
+      }
+    }
+  }
+  if(read(fd, buf, BSIZE) != 0){
+    printf("%s: extent file longer than %d blocks\n", s, n);
+    exit(1);
+  }
+  close(fd);
+}
+
+// files opened with O_EXTENT: write, read back, cut
+// back to nothing and grow again, over several rounds,
+// so that freed extents get reused.
+void
+extentfile(char *s)
+{
+  enum { ROUNDS = 4, N = NDIRECT + NINDIRECT/2 };
+  int fd, round, n;
+
+  unlink("extent.test");
+  for(round = 1; round <= ROUNDS; round++){
+    fd = open("extent.test", O_CREATE|O_RDWR|O_EXTENT);
+    if(fd < 0){
+      printf("%s: cannot create extent.test\n", s);
+      exit(1);
+    }
+    n = N / round;
+    extentwrite(s, fd, round, 0, n);
+    close(fd);
+    extentcheck(s, round, n);
+
+    // append to the file, without O_EXTENT: it
+    // stays an extent file, and grows in place.
+    fd = open("extent.test", O_RDWR);
+    if(fd < 0){
+      printf("%s: cannot reopen extent.test\n", s);
+      exit(1);
+    }
+    while(read(fd, buf, BSIZE) == BSIZE)
+      ;
+    extentwrite(s, fd, round, n, N);
+    close(fd);
+    extentcheck(s, round, N);
+
+    // there is no O_TRUNC: the only way to discard a
+    // file's blocks is to unlink it.
+    if(unlink("extent.test") < 0){
+      printf("%s: unlink extent.test failed\n", s);
+      exit(1);
+    }
+  }
+}
+
 void
 fourteen(char *s)
 {
@@ -1678,6 +1887,103 @@ sbrkmuch(char *s)
   }
 }
 
+// exercise a heap that covers two whole, aligned megapages,
+// which the kernel may map as megapages. user space cannot
+// see whether it did; the test checks that fork shares the
+// heap copy-on-write and that sbrk can shrink into it.
+void
+megapage(char *s)
+{
+  enum { MEGA=2*1024*1024 };
+  char *a, *p;
+  uint64 i;
+  int pid, xstatus;
+
+  a = sbrk(0);
+  p = (char*)(((uint64)a + MEGA - 1) & ~(uint64)(MEGA - 1));
+  if(sbrk(p + 2*MEGA - a) != a){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 2*MEGA; i += PGSIZE)
+    p[i] = i / PGSIZE;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(i = 0; i < 2*MEGA; i += PGSIZE){
+      if(p[i] != (char)(i / PGSIZE))
+        exit(1);
+      p[i] = 0;
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child saw wrong data\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 2*MEGA; i += PGSIZE){
+    if(p[i] != (char)(i / PGSIZE)){
+      printf("%s: child's store reached parent\n", s);
+      exit(1);
+    }
+  }
+
+  // give back half of the second megapage.
+  if(sbrk(-(MEGA/2)) == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk could not deallocate\n", s);
+    exit(1);
+  }
+  i = MEGA + MEGA/2 - PGSIZE;
+  if(p[i] != (char)(i / PGSIZE)){
+    printf("%s: shrinking lost data\n", s);
+    exit(1);
+  }
+  sbrk(-(sbrk(0) - a));
+}
+
+// a heap bigger than RAM must go out to the swap disk
+// and come back intact.
+void
+swapheap(char *s)
+{
+  enum { BIG=160*1024*1024 };
+  char *a;
+  uint64 i;
+  int pid, xstatus;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    a = sbrk(BIG);
+    if(a == (char*)0xffffffffffffffffL){
+      printf("%s: sbrk failed\n", s);
+      exit(1);
+    }
+    for(i = 0; i < BIG; i += PGSIZE)
+      *(uint64*)(a + i) = i;
+    for(i = 0; i < BIG; i += PGSIZE){
+      if(*(uint64*)(a + i) != i){
+        printf("%s: page at %p lost its contents\n", s, a + i);
+        exit(1);
+      }
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: could not use more memory than RAM\n", s);
+    exit(1);
+  }
+}
+
 // can we read the kernel's memory?
 void
 kernmem(char *s)
@@ -2148,6 +2454,8 @@ main(int argc, char *argv[])
     {bsstest, "bsstest"},
     {sbrkbasic, "sbrkbasic"},
     {sbrkmuch, "sbrkmuch"},
+    {megapage, "megapage"},
+    {swapheap, "swapheap"},
     {kernmem, "kernmem"},
     {sbrkfail, "sbrkfail"},
     {sbrkarg, "sbrkarg"},
@@ -2163,10 +2471,14 @@ main(int argc, char *argv[])
     {mem, "mem"},
     {pipe1, "pipe1"},
     {preempt, "preempt"},
+    {priority, "priority"},
+    {prioritydrop, "prioritydrop"},
+    {nanosleeptest, "nanosleep"},
     {exitwait, "exitwait"},
     {rmdot, "rmdot"},
     {fourteen, "fourteen"},
     {bigfile, "bigfile"},
+    {extentfile, "extentfile"},
     {dirfile, "dirfile"},
     {iref, "iref"},
     {forktest, "forktest"},